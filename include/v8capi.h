@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "v8capi_values.h"
@@ -32,9 +33,60 @@ struct v8_isolate;
 // own context and heap. VM uses only one thread
 struct v8_isolate* v8_new_isolate();
 
+// Isolate flags, may be combined
+//
+// The VM is used only by the thread which creates it: it is
+// never locked, which makes calls cheaper.
+// The VM must be used and deleted by that thread only,
+// v8_enter and v8_leave do nothing
+#define v8_thread_confined  1
+//
+// Promise jobs (microtasks) run only in v8_run_microtasks
+// and v8_poll, by default they also run when a call of
+// the VM returns
+#define v8_explicit_microtasks  2
+
+// Same as v8_new_isolate, but with isolate flags
+struct v8_isolate* v8_new_isolate_ex(int flags);
+
 void v8_delete_isolate(
     struct v8_isolate* isolate);
 
+// Starts a session: the VM is entered and locked by the
+// current thread until v8_leave is called, so calls within
+// the session skip entering and locking the VM. Other threads
+// wait for the end of the session. Sessions may be nested,
+// each v8_enter must be paired with v8_leave on the same thread
+void v8_enter(
+    struct v8_isolate* isolate);
+
+void v8_leave(
+    struct v8_isolate* isolate);
+
+// Conversion flags, may be combined
+//
+// JS arrays which contain only numbers are returned
+// as v8_number_array instead of v8_array
+#define v8_convert_number_arrays    1
+//
+// JS objects (including arrays, functions, etc.) are
+// not converted, v8_handle values which refer to them
+// are returned instead. Use v8_get_property and other
+// accessors below to convert only what is needed
+#define v8_convert_to_handles       2
+//
+// Objects, arrays, sets and maps which occur more than
+// once in a value are converted once, the next occurrences
+// are returned as v8_reference values. Cycles are always
+// returned as v8_reference values
+#define v8_convert_references       4
+
+// Changes how JS values returned from the VM are
+// converted to v8_value. By default no flags are set
+void v8_set_conversion_flags(
+    struct v8_isolate* isolate,
+    int flags);
+
 // To get message like this:
 //
 // my.js:3: ReferenceError: y is not defined
@@ -66,6 +118,21 @@ struct v8_error
 void v8_delete_error(
     struct v8_error* error);
 
+// Declares the keys of objects passed to the VM many
+// times. Key strings are created once, and objects built
+// with v8_new_shaped_object set the keys in the same
+// order, so V8 gives them the same hidden class.
+// keys are UTF-8 null-terminated strings. The shape
+// may be used only with the specified VM and must be
+// deleted before it
+struct v8_object_shape* v8_new_object_shape(
+    struct v8_isolate* isolate,
+    int32_t size,
+    const char* const* keys);
+
+void v8_delete_object_shape(
+    struct v8_object_shape* shape);
+
 struct v8_script;
 
 // Compiles and binds a JS script to the specified VM. 
@@ -94,14 +161,291 @@ void v8_terminate_script(
 void v8_delete_script(
     struct v8_script* script);
 
+// Resolves an import of the module at referrer location.
+// Writes the location which identifies the imported module
+// (e.g. an absolute path) and its source code, both allocated
+// with malloc, they are freed by the library. The code is
+// not used if the module is already loaded and may be left
+// NULL then. Returns false if the module is not found
+typedef bool (*v8_module_resolver)(
+    const char* specifier,
+    const char* referrer,
+    char** location,
+    char** code,
+    void* userdata);
+
+// Sets the resolver of imports of modules compiled by the VM
+void v8_set_module_resolver(
+    struct v8_isolate* isolate,
+    v8_module_resolver resolver,
+    void* userdata);
+
+// Compiles an ES module and loads its imports. All modules
+// of the VM share one context and are cached by location,
+// so a module imported by many modules is compiled and
+// evaluated once. If the location is already loaded, the
+// cached module is used and code is ignored.
+// v8_run_script evaluates the module once and returns its
+// exports, v8_get_function looks up names in the exports.
+// Returns NULL and populates the error structure if the
+// module or one of its imports fails to compile or load
+struct v8_script* v8_compile_module(
+    struct v8_isolate* isolate,
+    const char* code,
+    const char* location,
+    struct v8_error* error);
+
+// Sets a property of the global object of the script
+// without compiling code, e.g. to pass configuration or
+// per-request data. Modules of a VM share the global object.
+// If an error occurs (e.g. a setter throws) then false is
+// returned and the error structure is populated
+bool v8_set_global(
+    struct v8_script* script,
+    const char* name,
+    struct v8_value value,
+    struct v8_error* error);
+
+// Gets a property of the global object of the script,
+// the result is converted with the conversion flags of
+// the VM. A missing property is undefined
+bool v8_get_global(
+    struct v8_script* script,
+    const char* name,
+    struct v8_value* result,
+    struct v8_error* error);
+
+// Ring buffer of fixed size records written by C and read by
+// JS through a SharedArrayBuffer without copying and without
+// a call per record. There must be one writer thread and one
+// JS reader at a time.
+//
+// Layout of the buffer, offsets are in bytes, all fields
+// are int32:
+//
+// head         - the number of written records, is updated
+//                by the writer after a record is written
+// tail         - the number of read records, is updated by
+//                the reader after records are read
+// record_size, capacity - parameters of the channel
+//
+// The record with the number n is at
+// records_offset + (n & (capacity - 1)) * record_size.
+// Counters wrap around, the number of unread records is
+// (head - tail) | 0. JS reads head and writes tail with
+// Atomics.load and Atomics.store. Atomics.wait waiters can't
+// be woken from C, so the reader polls head, e.g. with
+// Atomics.wait with a timeout, or the host calls the reader
+// once per batch of records
+#define v8_channel_head_offset          0
+#define v8_channel_record_size_offset   4
+#define v8_channel_capacity_offset      8
+#define v8_channel_tail_offset          64
+#define v8_channel_records_offset       128
+
+struct v8_channel;
+
+// capacity must be a power of two. Returns NULL if the
+// parameters are invalid or the memory can't be allocated
+struct v8_channel* v8_new_channel(
+    int32_t record_size,
+    int32_t capacity);
+
+// Copies record_size bytes to the channel. Returns false
+// if the channel is full. Doesn't use the VM, so it may be
+// called from any thread while the VM runs
+bool v8_channel_write(
+    struct v8_channel* channel,
+    const void* record);
+
+// Returns the number of unread records
+int32_t v8_channel_size(
+    const struct v8_channel* channel);
+
+// Sets a global of the script to a SharedArrayBuffer over
+// the buffer of the channel. A channel may be attached to
+// many scripts and VMs
+bool v8_attach_channel(
+    struct v8_script* script,
+    const char* name,
+    struct v8_channel* channel,
+    struct v8_error* error);
+
+// The buffer is freed when JS doesn't refer to it anymore
+void v8_delete_channel(
+    struct v8_channel* channel);
+
+// C function callable from JS. Arguments are converted with
+// the conversion flags of the VM (so with v8_convert_to_handles
+// objects are passed as v8_handle values) and are deleted after
+// the call. result is undefined on entry and is deleted after
+// it is passed to JS. If false is returned a JS Error is
+// thrown, its message is result if it is a string
+typedef bool (*v8_host_callback)(
+    int argc,
+    const struct v8_value* argv,
+    struct v8_value* result,
+    void* userdata);
+
+// Makes the callback a global function of scripts compiled
+// by the VM after the call. Returns false if the name is not
+// a valid UTF-8 string. The registration lives as long as
+// the VM
+bool v8_register_function(
+    struct v8_isolate* isolate,
+    const char* name,
+    v8_host_callback callback,
+    void* userdata);
+
+// C function with numeric arguments and result, e.g. now(),
+// hash(key) or lookup(index). Arguments are converted to
+// numbers like by the unary plus in JS, missing ones are NaN.
+// No v8_value is created, so calls are much cheaper than calls
+// of v8_host_callback. The callback can't throw
+typedef double (*v8_number_callback)(
+    int argc,
+    const double* argv,
+    void* userdata);
+
+// Same as v8_register_function for numeric functions.
+// argc is the number of arguments, at most 16
+bool v8_register_number_function(
+    struct v8_isolate* isolate,
+    const char* name,
+    v8_number_callback callback,
+    int argc,
+    void* userdata);
+
+// Same as v8_register_function, but the function is
+// added to the global object of the compiled script only
+bool v8_register_script_function(
+    struct v8_script* script,
+    const char* name,
+    v8_host_callback callback,
+    void* userdata);
+
+struct v8_class;
+
+// Callbacks of native classes. self is the native object of
+// the receiver, arguments and results are handled like by
+// v8_host_callback. The message of a failed setter is
+// handled like the result of a failed v8_host_callback
+
+// Returns a new native object or NULL to throw an Error.
+// Native objects must be aligned to at least 2 bytes
+typedef void* (*v8_constructor_callback)(
+    int argc,
+    const struct v8_value* argv,
+    void* userdata);
+
+typedef bool (*v8_method_callback)(
+    void* self,
+    int argc,
+    const struct v8_value* argv,
+    struct v8_value* result,
+    void* userdata);
+
+typedef bool (*v8_getter_callback)(
+    void* self,
+    struct v8_value* result,
+    void* userdata);
+
+// value is deleted after the call
+typedef bool (*v8_setter_callback)(
+    void* self,
+    struct v8_value value,
+    struct v8_value* message,
+    void* userdata);
+
+// Called after the JS object is garbage collected, at the
+// latest by the next v8_poll, or when the VM is deleted.
+// Must not call the VM
+typedef void (*v8_finalizer)(
+    void* self,
+    void* userdata);
+
+struct v8_method_def
+{
+    const char* name;
+    v8_method_callback callback;
+};
+
+// A property without a setter is read only
+struct v8_accessor_def
+{
+    const char* name;
+    v8_getter_callback getter;
+    v8_setter_callback setter;
+};
+
+// Without a constructor the class can't be instantiated
+// from JS, finalizer may be NULL. userdata is passed to
+// all callbacks of the class
+struct v8_class_def
+{
+    const char* name;
+    v8_constructor_callback constructor;
+    v8_finalizer finalizer;
+    const struct v8_method_def* methods;
+    int methods_count;
+    const struct v8_accessor_def* accessors;
+    int accessors_count;
+    void* userdata;
+};
+
+// Registers a class whose JS objects keep a pointer to
+// a native object, so JS operates on native data in place.
+// The constructor is a global of scripts compiled by the VM
+// after the call. The class lives as long as the VM.
+// Returns NULL if a name is not a valid UTF-8 string
+struct v8_class* v8_register_class(
+    struct v8_isolate* isolate,
+    const struct v8_class_def* def);
+
+// Wraps a native object into a new JS object of the class
+// in the context of the script, the result is a v8_handle
+// value. The native object is finalized like objects made
+// by the constructor. Fails if the native object is already
+// wrapped and not finalized yet
+bool v8_new_native_object(
+    struct v8_script* script,
+    struct v8_class* cls,
+    void* self,
+    struct v8_value* result,
+    struct v8_error* error);
+
+// Returns the native object of a v8_handle value or
+// NULL if the value is not an object of the class
+void* v8_get_native_object(
+    struct v8_value handle,
+    struct v8_class* cls);
+
 struct v8_callable;
 
 // Get JS function from compiled script. Returns NULL 
-// if there is no function with specified name
+// if there is no function with specified name.
+// The name may be a dotted path, e.g. handlers.onEvent,
+// which is resolved once. Such a function is called
+// with the object which holds it as this, other
+// functions are called with the global object
 struct v8_callable* v8_get_function(
     struct v8_script* script,
     const char* name);
 
+// Get a method of the object referred to by a v8_handle
+// value, the method is called with the object as this.
+// Returns NULL if the property is not a function
+struct v8_callable* v8_get_method(
+    struct v8_value handle,
+    const char* name);
+
+// Get a function referred to by a v8_handle value, e.g.
+// returned by a script with v8_convert_to_handles. The
+// function is called with undefined as this. Returns
+// NULL if the value is not a function
+struct v8_callable* v8_get_callable(
+    struct v8_value handle);
+
 // Calls a JS function and returns true if successfull, 
 // the result of execution will be written to the result 
 // structure.
@@ -114,9 +458,227 @@ bool v8_call_function(
     struct v8_value* result,
     struct v8_error* error);
 
+// Calls a JS function count times under one lock of the VM.
+// argv holds count rows of argc arguments each, results and
+// errors hold count elements which are populated like by
+// v8_call_function. Returns true if all calls succeeded.
+// If the script is terminated the remaining calls are skipped,
+// their results are undefined and errors are populated
+bool v8_call_function_batch(
+    struct v8_callable* func,
+    int count,
+    int argc,
+    struct v8_value* argv,
+    struct v8_value* results,
+    struct v8_error* errors);
+
 void v8_delete_function(
     struct v8_callable* func);
 
+struct v8_promise;
+
+#define v8_promise_pending      0
+#define v8_promise_fulfilled    1
+#define v8_promise_rejected     2
+
+// Called once when the promise is settled, from the call
+// which runs its microtasks. value is the result or the
+// rejection reason converted with the conversion flags of
+// the VM, it is deleted after the call. The callback may
+// call the VM and delete the promise
+typedef void (*v8_promise_callback)(
+    struct v8_promise* promise,
+    struct v8_value* value,
+    void* userdata);
+
+// Calls a JS function, e.g. an async one, and returns a
+// pending promise of its result without waiting for it.
+// A result which is not a promise is fulfilled with the
+// next microtasks. callback may be NULL. If the call throws
+// then NULL is returned and the error structure is populated
+struct v8_promise* v8_call_function_async(
+    struct v8_callable* func,
+    int argc,
+    struct v8_value* argv,
+    v8_promise_callback callback,
+    void* userdata,
+    struct v8_error* error);
+
+int v8_promise_state(
+    const struct v8_promise* promise);
+
+// Writes the result or the rejection reason of a settled
+// promise, returns false if the promise is pending
+bool v8_promise_result(
+    struct v8_promise* promise,
+    struct v8_value* result);
+
+// A pending promise may be deleted, its callback is not
+// called then. Promises must be deleted before the VM
+void v8_delete_promise(
+    struct v8_promise* promise);
+
+// Runs all pending microtasks of the VM, so async JS
+// tasks proceed and callbacks of settled promises are called
+void v8_run_microtasks(
+    struct v8_isolate* isolate);
+
+// Runs pending tasks of the VM (e.g. finalizers of collected
+// native objects) and microtasks, returns the number of
+// promises of async calls which are still pending and
+// not deleted
+int v8_poll(
+    struct v8_isolate* isolate);
+
+struct v8_path;
+
+// Compiles a selector of a part of a JS value, e.g.
+//
+// meta.items[3].id
+// items[*].id
+// rows.*.name
+// headers["content-type"]
+//
+// * selects all elements of an array or all own
+// properties of an object. Returns NULL if the
+// path is malformed. A path is not bound to a VM
+// and may be used from any thread
+struct v8_path* v8_compile_path(
+    const char* path);
+
+void v8_delete_path(
+    struct v8_path* path);
+
+// Same as v8_run_script and v8_call_function, but only
+// the part of the result selected by the path is
+// converted. If the path has no wildcards the result
+// is the selected value or undefined if it is missing,
+// otherwise the result is an array of all selected values
+bool v8_run_script_select(
+    struct v8_script* script,
+    const struct v8_path* path,
+    struct v8_value* result,
+    struct v8_error* error);
+
+bool v8_call_function_select(
+    struct v8_callable* func,
+    int argc,
+    struct v8_value* argv,
+    const struct v8_path* path,
+    struct v8_value* result,
+    struct v8_error* error);
+
+// Growable buffer for JSON text. The text is written
+// null terminated, size does not include the terminator.
+// The buffer may be preallocated by the caller with
+// malloc, it is grown with realloc if needed and must be
+// released with free or v8_delete_json_buffer
+struct v8_json_buffer
+{
+    char* data;
+    int32_t size;
+    int32_t capacity;
+};
+
+// Calls a JS function with arguments given as a JSON array
+// text and writes the result serialized with JSON.stringify
+// to the buffer. Neither the arguments nor the result are
+// converted to v8_value. An undefined result is written as
+// undefined. If an error occurs (including invalid JSON)
+// then false is returned and the error structure is populated
+bool v8_call_function_json(
+    struct v8_callable* func,
+    const char* json_args,
+    int32_t length,
+    struct v8_json_buffer* result,
+    struct v8_error* error);
+
+void v8_delete_json_buffer(
+    struct v8_json_buffer* buffer);
+
+// Value serialized with the structured clone algorithm.
+// The value may be passed to another VM of the same
+// process only
+struct v8_serialized_value
+{
+    uint8_t* data;
+    size_t size;
+    void* transferred;
+};
+
+// Serialization flags
+//
+// Typed arrays and data views are serialized by reference:
+// their buffers are moved with the value and detached in
+// the source VM instead of being copied. Buffers which
+// can't be detached (e.g. shared ones) can't be moved
+#define v8_move_buffers     1
+
+// Serializes a value in the context of the script.
+// v8_handle values are serialized without converting
+// them to v8_value first. Buffers are copied unless
+// v8_move_buffers is set. If an error occurs (e.g. the
+// value contains a function) then false is returned and
+// the error structure is populated
+bool v8_serialize_value(
+    struct v8_script* script,
+    struct v8_value value,
+    int flags,
+    struct v8_serialized_value* result,
+    struct v8_error* error);
+
+// Deserializes a value in the context of the script, the
+// result is converted with the conversion flags of its VM.
+// Moved buffers are attached to the first deserialized
+// value, so a value with moved buffers can be
+// deserialized once
+bool v8_deserialize_value(
+    struct v8_script* script,
+    struct v8_serialized_value* data,
+    struct v8_value* result,
+    struct v8_error* error);
+
+void v8_delete_serialized_value(
+    struct v8_serialized_value* value);
+
+// Accessors of v8_handle values. Results are converted
+// with the conversion flags of the VM, so with
+// v8_convert_to_handles nested objects are returned
+// as handles too. If an error occurs (e.g. a getter
+// throws) then false is returned and the error
+// structure is populated
+
+bool v8_get_property(
+    struct v8_value handle,
+    const char* name,
+    struct v8_value* result,
+    struct v8_error* error);
+
+bool v8_get_element(
+    struct v8_value handle,
+    uint32_t index,
+    struct v8_value* result,
+    struct v8_error* error);
+
+// Writes an array of own property names
+bool v8_get_keys(
+    struct v8_value handle,
+    struct v8_value* result,
+    struct v8_error* error);
+
+// Converts the whole object regardless of
+// v8_convert_to_handles
+bool v8_materialize(
+    struct v8_value handle,
+    struct v8_value* result,
+    struct v8_error* error);
+
+// Returns the number of elements of arrays, typed
+// arrays, sets and maps, the number of own properties
+// of other objects or -1 if the value is not a handle
+int64_t v8_get_length(
+    struct v8_value handle);
+
 #ifdef __cplusplus
 }
 #endif
@@ -13,7 +13,7 @@ extern "C" {
 #define v8_null         2   // (void*) NULL
 #define v8_number       3   // double, int64_t
 #define v8_string       4   // const char*
-#define v8_big_int      5   // not implemented
+#define v8_big_int      5   // int64_t, uint64_t
 #define v8_symbol       6   // not implemented
 #define v8_object       7   // not implemented
 #define v8_array        8   // v8_array_value
@@ -21,6 +21,21 @@ extern "C" {
 #define v8_map          10  // v8_map_value
 #define v8_function     11  // not implemented
 #define v8_date         12  // not implemented
+#define v8_array_buffer         13  // v8_buffer_value
+#define v8_int8_array           14  // v8_buffer_value
+#define v8_uint8_array          15  // v8_buffer_value
+#define v8_uint8_clamped_array  16  // v8_buffer_value
+#define v8_int16_array          17  // v8_buffer_value
+#define v8_uint16_array         18  // v8_buffer_value
+#define v8_int32_array          19  // v8_buffer_value
+#define v8_uint32_array         20  // v8_buffer_value
+#define v8_float32_array        21  // v8_buffer_value
+#define v8_float64_array        22  // v8_buffer_value
+#define v8_big_int64_array      23  // v8_buffer_value
+#define v8_big_uint64_array     24  // v8_buffer_value
+#define v8_number_array         25  // v8_number_array_value
+#define v8_handle               26  // see v8_get_property
+#define v8_reference            27  // see v8_new_reference
 
 // You should not use data from this structure 
 // directly, use a helper function instead
@@ -66,13 +81,94 @@ struct v8_object_value
     struct v8_pair_value* data;
 };
 
+struct v8_object_shape;
+
+struct v8_shaped_object_value
+{
+    int32_t size;
+    struct v8_value* data;
+    struct v8_object_shape* shape;
+};
+
+// Exactly one of numbers and integers is not NULL
+struct v8_number_array_value
+{
+    int32_t size;
+    double* numbers;
+    int32_t* integers;
+};
+
+// size is the number of bytes for array buffers
+// and the number of elements for typed arrays. Buffers
+// of more than INT32_MAX bytes or elements are converted
+// to undefined
+struct v8_buffer_value
+{
+    int32_t size;
+    void* data;
+};
+
 struct v8_value v8_new_undefined();
 struct v8_value v8_new_boolean(bool value);
 struct v8_value v8_new_null();
 struct v8_value v8_new_number(double value);
 struct v8_value v8_new_integer(int64_t value);
 struct v8_value v8_new_string(const char* value, int32_t length);
+
+// Create BigInt values, unlike v8_new_integer values they
+// are passed to JS as BigInt and keep all 64 bits
+struct v8_value v8_new_big_int(int64_t value);
+struct v8_value v8_new_big_uint(uint64_t value);
+
+// Called once a caller-owned buffer is no longer referenced
+// neither by a value nor by any JS heap object. May be called
+// from any thread that uses the isolate or deletes the value
+typedef void (*v8_release_callback)(void* data, void* userdata);
+
+// Create strings which refer to a caller-owned buffer instead
+// of copying it, the buffer is passed to V8 as an external
+// string. The buffer must stay valid and unchanged until
+// the release callback is called. release may be NULL.
+// v8_new_external_string expects Latin-1 text,
+// v8_new_external_string16 expects UTF-16 text, length is
+// the number of characters
+struct v8_value v8_new_external_string(
+    const char* value,
+    int32_t length,
+    v8_release_callback release,
+    void* userdata);
+struct v8_value v8_new_external_string16(
+    const uint16_t* value,
+    int32_t length,
+    v8_release_callback release,
+    void* userdata);
+// Create an ArrayBuffer or a typed array (type is one of
+// v8_int8_array ... v8_big_uint64_array) over a caller-owned
+// buffer. JS gets a backing store which refers to the buffer
+// without copying, the buffer must stay valid until the release
+// callback is called. release may be NULL. size is the number
+// of bytes for array buffers and the number of elements for
+// typed arrays
+struct v8_value v8_new_array_buffer(
+    void* data,
+    int32_t size,
+    v8_release_callback release,
+    void* userdata);
+struct v8_value v8_new_typed_array(
+    int type,
+    void* data,
+    int32_t size,
+    v8_release_callback release,
+    void* userdata);
+// Create arrays of numbers stored in a contiguous buffer,
+// the data is copied. In JS they are ordinary arrays
+struct v8_value v8_new_number_array(const double* data, int32_t size);
+struct v8_value v8_new_integer_array(const int32_t* data, int32_t size);
 struct v8_value v8_new_object(int32_t size);
+// Creates an object with keys of the shape, the values are
+// undefined and should be set through v8_to_shaped_object.
+// The shape must outlive the value
+struct v8_value v8_new_shaped_object(struct v8_object_shape* shape);
 struct v8_value v8_new_array(int32_t size);
 struct v8_value v8_new_set(int32_t size);
 struct v8_value v8_new_map(int32_t size);
@@ -84,24 +180,61 @@ bool v8_is_number(struct v8_value value);
 bool v8_is_double(struct v8_value value);
 bool v8_is_integer(struct v8_value value);
 bool v8_is_string(struct v8_value value);
+bool v8_is_big_int(struct v8_value value);
 bool v8_is_object(struct v8_value value);
+bool v8_is_shaped_object(struct v8_value value);
 bool v8_is_array(struct v8_value value);
 bool v8_is_set(struct v8_value value);
 bool v8_is_map(struct v8_value value);
+bool v8_is_array_buffer(struct v8_value value);
+bool v8_is_typed_array(struct v8_value value);
+bool v8_is_number_array(struct v8_value value);
+bool v8_is_handle(struct v8_value value);
+bool v8_is_reference(struct v8_value value);
 
 int v8_get_value_type(struct v8_value value);
 
+// A reference is a second occurrence of an object, an array,
+// a set or a map within one value, e.g. a shared sub-object
+// or a cycle of a value returned from JS. It does not own
+// the referenced value: deleting a reference does nothing
+// and it must not be used after the referenced value is
+// deleted. Both ends are one JS value after conversion to JS.
+// v8_new_reference returns undefined for other values
+struct v8_value v8_new_reference(struct v8_value value);
+// Returns the referenced value which must not be deleted,
+// other values are returned as is
+struct v8_value v8_resolve_reference(struct v8_value value);
+
 bool v8_to_bool(struct v8_value value);
 double v8_to_double(struct v8_value value);
 int32_t v8_to_int32(struct v8_value value);
 uint32_t v8_to_uint32(struct v8_value value);
+// v8_to_int64 and v8_to_uint64 accept numbers and BigInts.
+// BigInts received from JS which do not fit into 64 bits
+// are converted to strings with their decimal notation.
+// v8_to_int64 saturates unsigned BigInts above INT64_MAX
 int64_t v8_to_int64(struct v8_value value);
+uint64_t v8_to_uint64(struct v8_value value);
+// For external UTF-16 strings returns an empty value.
+// Equal keys of objects returned from the VM by one call
+// share one string, so they have equal data pointers
 struct v8_string_value v8_to_string(struct v8_value* value);
+// For shaped objects returns an empty value
 struct v8_object_value v8_to_object(struct v8_value value);
+struct v8_shaped_object_value v8_to_shaped_object(struct v8_value value);
 struct v8_array_value v8_to_array(struct v8_value value);
 struct v8_set_value v8_to_set(struct v8_value value);
 struct v8_map_value v8_to_map(struct v8_value value);
-
+// Array buffers and typed arrays received from JS are views
+// of the JS backing store, it is kept alive until the value
+// is deleted
+struct v8_buffer_value v8_to_array_buffer(struct v8_value value);
+struct v8_buffer_value v8_to_typed_array(struct v8_value value);
+struct v8_number_array_value v8_to_number_array(struct v8_value value);
+
+// Values must be deleted before the VM they
+// came from, handles refer to the VM heap
 void v8_delete_value(struct v8_value* value);
 
 #ifdef __cplusplus
@@ -1,7 +1,14 @@
+#include <atomic>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <memory>
+#include <new>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <libplatform/libplatform.h>
@@ -16,6 +23,9 @@ struct v8_instance
     std::unique_ptr<v8::Platform> platform_;
 };
 
+// Platform of the instance, v8_poll runs its tasks
+v8::Platform* current_platform = nullptr;
+
 v8_instance* v8_new_instance(
     unsigned thread_pool_size,
     const char* exec_path)
@@ -31,6 +41,8 @@ v8_instance* v8_new_instance(
     v8::V8::InitializePlatform(instance->platform_.get());
     v8::V8::Initialize();
 
+    current_platform = instance->platform_.get();
+
     return instance.release();
 }
 
@@ -47,29 +59,209 @@ void v8_delete_instance(
     v8::V8::Dispose();
     v8::V8::ShutdownPlatform();
 
+    current_platform = nullptr;
+
     delete instance;
 }
 
+// Function registered with v8_register_function
+// or v8_register_number_function
+struct host_function
+{
+    v8::Persistent<v8::String> name_;
+    v8::Persistent<v8::FunctionTemplate> template_;
+    v8_host_callback callback_ = nullptr;
+    v8_number_callback number_callback_ = nullptr;
+    int argc_ = 0;
+    void* userdata_ = nullptr;
+
+    // Added to all new contexts of the VM
+    bool global_ = false;
+};
+
+struct native_object;
+
+// Data of a method or an accessor of a native class
+struct class_member
+{
+    v8_class* class_;
+    v8_method_callback method_;
+    v8_getter_callback getter_;
+    v8_setter_callback setter_;
+};
+
+struct v8_class
+{
+    v8::Persistent<v8::String> name_;
+    v8::Persistent<v8::FunctionTemplate> template_;
+    v8_constructor_callback constructor_;
+    v8_finalizer finalizer_;
+    void* userdata_;
+
+    // Is not resized after the class is built, callbacks
+    // refer to its elements
+    std::vector<class_member> members_;
+
+    // Objects which are not finalized yet by their native
+    // objects, a native object is wrapped only once
+    std::unordered_map<void*, native_object*> objects_;
+};
+
+// JS object which owns a native object of a class,
+// the native object is kept in the internal field
+struct native_object
+{
+    v8::Global<v8::Object> object_;
+    v8_class* class_;
+    void* self_;
+};
+
+void finalize_native_object(
+    native_object* object)
+{
+    const v8_class* cls = object->class_;
+
+    if (cls->finalizer_)
+    {
+        cls->finalizer_(object->self_, cls->userdata_);
+    }
+
+    object->object_.Reset();
+
+    delete object;
+}
+
+struct v8_promise
+{
+    v8::Isolate* isolate_;
+    v8::Persistent<v8::Context> context_;
+    v8::Persistent<v8::Promise> promise_;
+    v8_promise_callback callback_;
+    void* userdata_;
+
+    // Is updated when the reaction of the promise runs
+    int state_ = v8_promise_pending;
+
+    // Deleted by the user while pending, it is freed
+    // when settled or with the VM
+    bool deleted_ = false;
+};
+
+// ES modules compiled by the VM. They are instantiated in one
+// context, so each module is compiled and instantiated once
+struct module_cache
+{
+    v8::Global<v8::Context> context_;
+
+    // Location -> module
+    std::unordered_map<std::string, v8::Global<v8::Module>> modules_;
+
+    // Identity hash of a module -> its location
+    std::unordered_multimap<int, std::string> locations_;
+
+    v8_module_resolver resolver_ = nullptr;
+    void* userdata_ = nullptr;
+};
+
 struct v8_isolate
 {
-    std::unique_ptr<v8::ArrayBuffer::Allocator> allocator_;
+    // Backing stores moved to other VMs keep the allocator
+    std::shared_ptr<v8::ArrayBuffer::Allocator> allocator_;
     v8::Isolate* isolate_;
+    int conversion_flags_ = 0;
+
+    // Session started with v8_enter
+    std::unique_ptr<v8::Locker> session_locker_;
+    int session_depth_ = 0;
+
+    // A thread-confined VM is used only by the thread which
+    // created it and is never locked
+    bool thread_confined_ = false;
+    std::thread::id owner_;
+
+    std::vector<std::unique_ptr<host_function>> host_functions_;
+    std::vector<std::unique_ptr<v8_class>> classes_;
+
+    // Pending promises of async calls, including
+    // deleted_promises_ promises deleted by the user
+    std::unordered_set<v8_promise*> promises_;
+    int deleted_promises_ = 0;
+
+    std::unique_ptr<module_cache> modules_;
 };
 
+v8_isolate* get_isolate(
+    v8::Isolate* isolate)
+{
+    return static_cast<v8_isolate*>(isolate->GetData(0));
+}
+
+int get_conversion_flags(
+    v8::Isolate* isolate)
+{
+    return get_isolate(isolate)->conversion_flags_;
+}
+
+vm_scope::vm_scope(v8::Isolate* isolate)
+{
+    const v8_isolate* instance = get_isolate(isolate);
+
+    if (instance->thread_confined_)
+    {
+        assert(instance->owner_ == std::this_thread::get_id());
+
+        // Other confined VMs of the thread may be entered in
+        // between, so the VM is entered per call, not once
+        if (v8::Isolate::GetCurrent() != isolate)
+        {
+            isolate_scope_.emplace(isolate);
+        }
+
+        return;
+    }
+
+    if (v8::Isolate::GetCurrent() == isolate && v8::Locker::IsLocked(isolate))
+    {
+        return;
+    }
+
+    isolate_scope_.emplace(isolate);
+    locker_.emplace(isolate);
+}
+
 v8_isolate* v8_new_isolate()
+{
+    return v8_new_isolate_ex(0);
+}
+
+v8_isolate* v8_new_isolate_ex(
+    int flags)
 {
     auto instance = std::make_unique<v8_isolate>();
 
     instance->allocator_.reset(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
 
     v8::Isolate::CreateParams create_params;
-    create_params.array_buffer_allocator = instance->allocator_.get();
+    create_params.array_buffer_allocator_shared = instance->allocator_;
     create_params.only_terminate_in_safe_scope = true;
 
     instance->isolate_ = v8::Isolate::New(create_params);
 
     instance->isolate_->SetCaptureStackTraceForUncaughtExceptions(true);
 
+    instance->isolate_->SetData(0, instance.get());
+
+    if (flags & v8_explicit_microtasks)
+    {
+        instance->isolate_->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+    }
+
+    if (flags & v8_thread_confined)
+    {
+        instance->thread_confined_ = true;
+        instance->owner_ = std::this_thread::get_id();
+    }
+
     return instance.release();
 }
 
@@ -83,11 +275,114 @@ void v8_delete_isolate(
         return;
     }
 
+    assert(isolate->session_depth_ == 0);
+
+    assert(!isolate->thread_confined_ || isolate->owner_ == std::this_thread::get_id());
+
+    // Objects which are not collected yet are finalized here
+    for (const auto& cls : isolate->classes_)
+    {
+        for (const auto& object : cls->objects_)
+        {
+            finalize_native_object(object.second);
+        }
+    }
+
+    isolate->modules_.reset();
+    isolate->classes_.clear();
+    isolate->host_functions_.clear();
+
+    // Only promises deleted while pending may be left
+    for (v8_promise* promise : isolate->promises_)
+    {
+        assert(promise->deleted_);
+        delete promise;
+    }
+
     isolate->isolate_->Dispose();
 
     delete isolate;
 }
 
+void v8_enter(
+    v8_isolate* isolate)
+{
+    assert(isolate);
+
+    if (!isolate)
+    {
+        return;
+    }
+
+    if (isolate->thread_confined_)
+    {
+        assert(isolate->owner_ == std::this_thread::get_id());
+        return;
+    }
+
+    // Only the thread which holds the lock may see its own session
+    if (v8::Locker::IsLocked(isolate->isolate_) && isolate->session_depth_ > 0)
+    {
+        ++isolate->session_depth_;
+        return;
+    }
+
+    auto locker = std::make_unique<v8::Locker>(isolate->isolate_);
+    isolate->isolate_->Enter();
+
+    isolate->session_locker_ = std::move(locker);
+    isolate->session_depth_ = 1;
+}
+
+void v8_leave(
+    v8_isolate* isolate)
+{
+    assert(isolate);
+
+    if (!isolate)
+    {
+        return;
+    }
+
+    if (isolate->thread_confined_)
+    {
+        assert(isolate->owner_ == std::this_thread::get_id());
+        return;
+    }
+
+    const bool in_session = v8::Locker::IsLocked(isolate->isolate_)
+        && isolate->session_depth_ > 0;
+
+    assert(in_session);
+
+    if (!in_session)
+    {
+        return;
+    }
+
+    if (--isolate->session_depth_ > 0)
+    {
+        return;
+    }
+
+    isolate->isolate_->Exit();
+    isolate->session_locker_.reset();
+}
+
+void v8_set_conversion_flags(
+    v8_isolate* isolate,
+    int flags)
+{
+    assert(isolate);
+
+    if (!isolate)
+    {
+        return;
+    }
+
+    isolate->conversion_flags_ = flags;
+}
+
 void v8_delete_error(
     v8_error* error)
 {
@@ -104,6 +399,67 @@ void v8_delete_error(
     delete[] error->stack_trace;
 }
 
+v8_object_shape* v8_new_object_shape(
+    v8_isolate* isolate,
+    int32_t size,
+    const char* const* keys)
+{
+    assert(isolate);
+    assert(size >= 0);
+    assert(keys || size == 0);
+
+    if (!isolate || size < 0 || (!keys && size != 0))
+    {
+        return nullptr;
+    }
+
+    vm_scope vm(isolate->isolate_);
+
+    v8::HandleScope handle_scope(isolate->isolate_);
+
+    auto instance = std::make_unique<v8_object_shape>();
+
+    instance->isolate_ = isolate->isolate_;
+    instance->size_ = size;
+    instance->keys_.reset(new v8::Persistent<v8::String>[size]);
+
+    for (int32_t i = 0; i < size; ++i)
+    {
+        assert(keys[i]);
+
+        v8::Local<v8::String> key;
+        if (!keys[i] || !v8::String::NewFromUtf8(
+            isolate->isolate_, keys[i], v8::NewStringType::kInternalized).
+            ToLocal(&key))
+        {
+            v8_delete_object_shape(instance.release());
+            return nullptr;
+        }
+
+        instance->keys_[i].Reset(isolate->isolate_, key);
+    }
+
+    return instance.release();
+}
+
+void v8_delete_object_shape(
+    v8_object_shape* shape)
+{
+    assert(shape);
+
+    if (!shape)
+    {
+        return;
+    }
+
+    for (int32_t i = 0; i < shape->size_; ++i)
+    {
+        shape->keys_[i].Reset();
+    }
+
+    delete shape;
+}
+
 char* duplicate_string(
     const char* string)
 {
@@ -265,298 +621,3047 @@ void make_error(
     }
 }
 
-struct v8_script
-{
-    v8::Isolate* isolate_;
-    v8::Persistent<v8::Context> context_;
-    v8::Persistent<v8::Script> script_;
-};
+const int small_args_count = 16;
 
-v8_script* v8_compile_script(
-    v8_isolate* isolate,
-    const char* code,
-    const char* location,
-    v8_error* error)
+// Arguments of a host function call converted to v8_value,
+// they are deleted with the object
+class host_args
 {
-    assert(isolate);
-    assert(code);
-    assert(location);
-    assert(error);
-
-    if (!isolate || !code || !location || !error)
+public:
+    explicit host_args(const v8::FunctionCallbackInfo<v8::Value>& info)
+        : argc_(info.Length())
+        , argv_(small_)
     {
-        return nullptr;
-    }
+        v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
 
-    clean_error(*error);
+        if (argc_ > small_args_count)
+        {
+            large_.resize(static_cast<size_t>(argc_));
+            argv_ = large_.data();
+        }
 
-    v8::Isolate::Scope isolate_scope(isolate->isolate_);
+        for (int i = 0; i < argc_; ++i)
+        {
+            argv_[i] = from_v8_value(context, info[i]);
+        }
+    }
 
-    v8::Locker locker(isolate->isolate_);
+    ~host_args()
+    {
+        for (int i = 0; i < argc_; ++i)
+        {
+            v8_delete_value(&argv_[i]);
+        }
+    }
 
-    v8::HandleScope handle_scope(isolate->isolate_);
+    host_args(const host_args&) = delete;
+    host_args& operator=(const host_args&) = delete;
 
-    v8::Local<v8::String> code_str;
-    if (!v8::String::NewFromUtf8(
-        isolate->isolate_, code, v8::NewStringType::kInternalized).
-        ToLocal(&code_str))
+    int argc() const
     {
-        return nullptr;
+        return argc_;
     }
 
-    v8::Local<v8::String> location_str;
-    if (!v8::String::NewFromUtf8(
-        isolate->isolate_, location, v8::NewStringType::kInternalized).
-        ToLocal(&location_str))
+    const v8_value* argv() const
     {
-        return nullptr;
+        return argv_;
     }
 
-    v8::ScriptOrigin origin(location_str);
-
-    v8::Local<v8::Context> context = v8::Context::New(isolate->isolate_);
-
-    context->AllowCodeGenerationFromStrings(false);
+private:
+    int argc_;
+    v8_value* argv_;
+    v8_value small_[small_args_count];
+    std::vector<v8_value> large_;
+};
 
-    v8::Context::Scope context_scope(context);
+// Returns the result of a host callback to JS or throws an
+// Error if the callback failed, the result is deleted
+void return_host_result(
+    const v8::FunctionCallbackInfo<v8::Value>& info,
+    bool succeeded,
+    v8_value& result)
+{
+    v8::Isolate* isolate = info.GetIsolate();
 
-    v8::TryCatch try_catch(isolate->isolate_);
+    v8::Local<v8::Context> context = isolate->GetCurrentContext();
 
-    v8::Local<v8::Script> script;
-    if (!v8::Script::Compile(context, code_str, &origin).ToLocal(&script))
+    if (succeeded)
     {
-        make_error(isolate->isolate_, try_catch, error);
-        return nullptr;
+        info.GetReturnValue().Set(to_v8_value(context, result));
     }
+    else
+    {
+        v8::Local<v8::String> message;
+        if (v8_is_string(result))
+        {
+            message = v8::Local<v8::String>::Cast(to_v8_value(context, result));
+        }
+        else
+        {
+            message = v8::String::NewFromUtf8Literal(isolate, "Host function failed");
+        }
 
-    auto instance = std::make_unique<v8_script>();
-
-    instance->isolate_ = isolate->isolate_;
-    instance->context_.Reset(isolate->isolate_, context);
-    instance->script_.Reset(isolate->isolate_, script);
+        isolate->ThrowException(v8::Exception::Error(message));
+    }
 
-    return instance.release();
+    v8_delete_value(&result);
 }
 
-bool v8_run_script(
-    v8_script* script,
-    v8_value* result,
-    v8_error* error)
+void call_host_function(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
 {
-    assert(script);
-    assert(result);
-    assert(error);
+    const auto* function =
+        static_cast<const host_function*>(info.Data().As<v8::External>()->Value());
+
+    v8_value result = v8_new_undefined();
 
-    if (!script || !result || !error)
+    bool succeeded;
     {
-        return false;
+        host_args args(info);
+
+        succeeded = function->callback_(
+            args.argc(), args.argv(), &result, function->userdata_);
     }
 
-    clean_error(*error);
+    return_host_result(info, succeeded, result);
+}
 
-    v8::Isolate* isolate = script->isolate_;
+// Numeric arguments are read in place, no v8_value is created
+void call_number_function(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
+{
+    const auto* function =
+        static_cast<const host_function*>(info.Data().As<v8::External>()->Value());
 
-    v8::Isolate::Scope isolate_scope(isolate);
+    double argv[small_args_count];
 
-    v8::Locker locker(isolate);
+    for (int i = 0; i < function->argc_; ++i)
+    {
+        v8::Local<v8::Value> arg = info[i];
 
-    v8::HandleScope handle_scope(isolate);
+        if (arg->IsNumber())
+        {
+            argv[i] = v8::Local<v8::Number>::Cast(arg)->Value();
+        }
+        else if (!arg->NumberValue(info.GetIsolate()->GetCurrentContext()).To(&argv[i]))
+        {
+            return;
+        }
+    }
 
-    v8::Local<v8::Context> context =
-        v8::Local<v8::Context>::New(isolate, script->context_);
+    info.GetReturnValue().Set(
+        function->number_callback_(function->argc_, argv, function->userdata_));
+}
 
-    v8::Context::Scope context_scope(context);
+// The caller sets the callback of the function
+std::unique_ptr<host_function> new_host_function(
+    v8::Isolate* isolate,
+    const char* name,
+    v8::FunctionCallback call,
+    int length)
+{
+    v8::Local<v8::String> name_str;
+    if (!v8::String::NewFromUtf8(
+        isolate, name, v8::NewStringType::kInternalized).ToLocal(&name_str))
+    {
+        return nullptr;
+    }
 
-    v8::TryCatch try_catch(isolate);
+    auto function = std::make_unique<host_function>();
 
-    v8::Local<v8::Script> compiled_script =
-        v8::Local<v8::Script>::New(isolate, script->script_);
+    v8::Local<v8::FunctionTemplate> tmpl = v8::FunctionTemplate::New(
+        isolate, call, v8::External::New(isolate, function.get()),
+        v8::Local<v8::Signature>(), length, v8::ConstructorBehavior::kThrow);
 
-    v8::Local<v8::Value> ret_val;
+    tmpl->SetClassName(name_str);
 
-    {
-        v8::Isolate::SafeForTerminationScope isolate_scope(isolate);
+    function->name_.Reset(isolate, name_str);
+    function->template_.Reset(isolate, tmpl);
 
-        if (!compiled_script->Run(context).ToLocal(&ret_val))
-        {
-            make_error(isolate, try_catch, error);
-            return false;
-        }
+    return function;
+}
+
+// Adds a global function, e.g. a host function or
+// the constructor of a native class
+bool install_global(
+    v8::Local<v8::Context> context,
+    const v8::Persistent<v8::String>& name,
+    const v8::Persistent<v8::FunctionTemplate>& tmpl)
+{
+    v8::Isolate* isolate = context->GetIsolate();
+
+    v8::Local<v8::Function> func;
+    if (!v8::Local<v8::FunctionTemplate>::New(isolate, tmpl)->
+        GetFunction(context).ToLocal(&func))
+    {
+        return false;
     }
 
-    *result = from_v8_value(context, ret_val);
-    return true;
+    return context->Global()->Set(
+        context, v8::Local<v8::String>::New(isolate, name), func).
+        FromMaybe(false);
 }
 
-void v8_terminate_script(
-    v8_script* script)
+bool v8_register_function(
+    v8_isolate* isolate,
+    const char* name,
+    v8_host_callback callback,
+    void* userdata)
 {
-    assert(script);
+    assert(isolate);
+    assert(name);
+    assert(callback);
 
-    if (!script)
+    if (!isolate || !name || !callback)
     {
-        return;
+        return false;
     }
 
-    script->isolate_->TerminateExecution();
+    vm_scope vm(isolate->isolate_);
+
+    v8::HandleScope handle_scope(isolate->isolate_);
+
+    auto function = new_host_function(isolate->isolate_, name, call_host_function, 0);
+    if (!function)
+    {
+        return false;
+    }
+
+    function->callback_ = callback;
+    function->userdata_ = userdata;
+    function->global_ = true;
+
+    isolate->host_functions_.push_back(std::move(function));
+
+    return true;
 }
 
-void v8_delete_script(
-    v8_script* script)
+bool v8_register_number_function(
+    v8_isolate* isolate,
+    const char* name,
+    v8_number_callback callback,
+    int argc,
+    void* userdata)
 {
-    assert(script);
+    assert(isolate);
+    assert(name);
+    assert(callback);
+    assert(argc >= 0 && argc <= small_args_count);
 
-    if (!script)
+    if (!isolate || !name || !callback || argc < 0 || argc > small_args_count)
     {
-        return;
+        return false;
     }
 
-    script->context_.Reset();
-    script->script_.Reset();
+    vm_scope vm(isolate->isolate_);
 
-    delete script;
+    v8::HandleScope handle_scope(isolate->isolate_);
+
+    auto function = new_host_function(isolate->isolate_, name, call_number_function, argc);
+    if (!function)
+    {
+        return false;
+    }
+
+    function->number_callback_ = callback;
+    function->argc_ = argc;
+    function->userdata_ = userdata;
+    function->global_ = true;
+
+    isolate->host_functions_.push_back(std::move(function));
+
+    return true;
 }
 
-struct v8_callable
+void* get_native_self(
+    v8::Local<v8::Object> object)
 {
-    v8_script* script_;
-    v8::Persistent<v8::Function> func_;
-};
+    return object->GetAlignedPointerFromInternalField(0);
+}
 
-v8_callable* v8_get_function(
-    struct v8_script* script,
-    const char* name)
+void finalize_collected_object(
+    const v8::WeakCallbackInfo<native_object>& info)
 {
-    assert(script);
-    assert(name);
+    native_object* object = info.GetParameter();
 
-    if (!script || !name)
+    object->class_->objects_.erase(object->self_);
+
+    finalize_native_object(object);
+}
+
+// V8 allows only to reset the handle in the first pass, the
+// finalizer is user code, so it is called in the second pass
+void on_native_object_collected(
+    const v8::WeakCallbackInfo<native_object>& info)
+{
+    info.GetParameter()->object_.Reset();
+    info.SetSecondPassCallback(finalize_collected_object);
+}
+
+// Throws an Error if the native object is already wrapped
+bool attach_native_object(
+    v8::Isolate* isolate,
+    v8_class* cls,
+    v8::Local<v8::Object> object,
+    void* self)
+{
+    if (cls->objects_.count(self) > 0)
     {
-        return nullptr;
+        isolate->ThrowException(v8::Exception::Error(
+            v8::String::NewFromUtf8Literal(isolate, "Native object is already wrapped")));
+        return false;
     }
 
-    v8::Isolate::Scope isolate_scope(script->isolate_);
+    object->SetAlignedPointerInInternalField(0, self);
 
-    v8::Locker locker(script->isolate_);
+    auto native = new native_object;
 
-    v8::HandleScope handle_scope(script->isolate_);
+    native->class_ = cls;
+    native->self_ = self;
+    native->object_.Reset(isolate, object);
+    native->object_.SetWeak(
+        native, on_native_object_collected, v8::WeakCallbackType::kParameter);
 
-    v8::Local<v8::String> func_name;
+    cls->objects_.emplace(self, native);
 
-    if (!v8::String::NewFromUtf8(
-        script->isolate_, name, v8::NewStringType::kNormal).ToLocal(&func_name))
+    return true;
+}
+
+void construct_native_object(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
+{
+    auto* cls = static_cast<v8_class*>(info.Data().As<v8::External>()->Value());
+
+    v8::Isolate* isolate = info.GetIsolate();
+
+    if (!info.IsConstructCall() || !cls->constructor_)
     {
-        return nullptr;
+        isolate->ThrowException(v8::Exception::TypeError(
+            v8::String::NewFromUtf8Literal(isolate, "Illegal constructor")));
+        return;
     }
 
-    v8::Local<v8::Context> context =
-        v8::Local<v8::Context>::New(script->isolate_, script->context_);
+    void* self;
+    {
+        host_args args(info);
+
+        self = cls->constructor_(args.argc(), args.argv(), cls->userdata_);
+    }
 
-    v8:: Local<v8::Value> func;
-    if (!context->Global()->Get(context, func_name).ToLocal(&func))
+    if (!self)
     {
-        return nullptr;
+        isolate->ThrowException(v8::Exception::Error(
+            v8::String::NewFromUtf8Literal(isolate, "Native constructor failed")));
+        return;
     }
 
-    if (!func->IsFunction())
+    attach_native_object(isolate, cls, info.This(), self);
+}
+
+// Receivers of methods and accessors are checked
+// by V8 with the signature of the class
+void call_native_method(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
+{
+    const auto* member =
+        static_cast<const class_member*>(info.Data().As<v8::External>()->Value());
+
+    void* self = get_native_self(info.Holder());
+
+    v8_value result = v8_new_undefined();
+
+    bool succeeded;
     {
-        return nullptr;
+        host_args args(info);
+
+        succeeded = member->method_(
+            self, args.argc(), args.argv(), &result, member->class_->userdata_);
     }
 
-    auto instance = std::make_unique<v8_callable>();
+    return_host_result(info, succeeded, result);
+}
 
-    instance->script_ = script;
-    instance->func_.Reset(script->isolate_, v8::Local<v8::Function>::Cast(func));
+void call_native_getter(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
+{
+    const auto* member =
+        static_cast<const class_member*>(info.Data().As<v8::External>()->Value());
 
-    return instance.release();
+    v8_value result = v8_new_undefined();
+
+    const bool succeeded = member->getter_(
+        get_native_self(info.Holder()), &result, member->class_->userdata_);
+
+    return_host_result(info, succeeded, result);
 }
 
-bool v8_call_function(
-    v8_callable* func,
-    int argc,
-    v8_value* argv,
-    v8_value* result,
-    v8_error* error)
+void call_native_setter(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
 {
-    assert(func);
-    assert(error);
+    const auto* member =
+        static_cast<const class_member*>(info.Data().As<v8::External>()->Value());
 
-    if (!func || !error)
+    v8_value value = from_v8_value(info.GetIsolate()->GetCurrentContext(), info[0]);
+
+    v8_value message = v8_new_undefined();
+
+    const bool succeeded = member->setter_(
+        get_native_self(info.Holder()), value, &message, member->class_->userdata_);
+
+    v8_delete_value(&value);
+
+    return_host_result(info, succeeded, message);
+}
+
+v8_class* v8_register_class(
+    v8_isolate* isolate,
+    const v8_class_def* def)
+{
+    assert(isolate);
+    assert(def);
+
+    if (!isolate || !def)
     {
-        return false;
+        return nullptr;
     }
 
-    assert(argc >= 0);
+    assert(def->name);
+    assert(def->methods_count >= 0);
+    assert(def->methods || def->methods_count == 0);
+    assert(def->accessors_count >= 0);
+    assert(def->accessors || def->accessors_count == 0);
 
-    if (argc < 0)
+    if (!def->name
+        || def->methods_count < 0 || (!def->methods && def->methods_count > 0)
+        || def->accessors_count < 0 || (!def->accessors && def->accessors_count > 0))
     {
-        return false;
+        return nullptr;
     }
-    else if (argc == 0)
+
+    v8::Isolate* js_isolate = isolate->isolate_;
+
+    vm_scope vm(js_isolate);
+
+    v8::HandleScope handle_scope(js_isolate);
+
+    v8::Local<v8::String> name;
+    if (!v8::String::NewFromUtf8(
+        js_isolate, def->name, v8::NewStringType::kInternalized).ToLocal(&name))
     {
-        assert(!argv);
+        return nullptr;
+    }
 
-        if (argv)
+    auto cls = std::make_unique<v8_class>();
+
+    cls->constructor_ = def->constructor;
+    cls->finalizer_ = def->finalizer;
+    cls->userdata_ = def->userdata;
+    cls->members_.reserve(static_cast<size_t>(def->methods_count + def->accessors_count));
+
+    v8::Local<v8::FunctionTemplate> tmpl = v8::FunctionTemplate::New(
+        js_isolate, construct_native_object, v8::External::New(js_isolate, cls.get()));
+
+    tmpl->SetClassName(name);
+    tmpl->InstanceTemplate()->SetInternalFieldCount(1);
+
+    v8::Local<v8::Signature> signature = v8::Signature::New(js_isolate, tmpl);
+
+    v8::Local<v8::ObjectTemplate> prototype = tmpl->PrototypeTemplate();
+
+    for (int i = 0; i < def->methods_count; ++i)
+    {
+        const v8_method_def& method = def->methods[i];
+
+        assert(method.name);
+        assert(method.callback);
+
+        v8::Local<v8::String> method_name;
+        if (!method.name || !method.callback || !v8::String::NewFromUtf8(
+            js_isolate, method.name, v8::NewStringType::kInternalized).ToLocal(&method_name))
         {
-            return false;
+            return nullptr;
         }
+
+        cls->members_.push_back({ cls.get(), method.callback, nullptr, nullptr });
+
+        prototype->Set(method_name, v8::FunctionTemplate::New(
+            js_isolate, call_native_method, v8::External::New(js_isolate, &cls->members_.back()),
+            signature, 0, v8::ConstructorBehavior::kThrow));
     }
-    else
+
+    for (int i = 0; i < def->accessors_count; ++i)
     {
-        assert(argv);
+        const v8_accessor_def& accessor = def->accessors[i];
 
-        if (!argv)
+        assert(accessor.name);
+        assert(accessor.getter);
+
+        v8::Local<v8::String> accessor_name;
+        if (!accessor.name || !accessor.getter || !v8::String::NewFromUtf8(
+            js_isolate, accessor.name, v8::NewStringType::kInternalized).ToLocal(&accessor_name))
         {
-            return false;
+            return nullptr;
+        }
+
+        cls->members_.push_back({ cls.get(), nullptr, accessor.getter, accessor.setter });
+
+        v8::Local<v8::External> data = v8::External::New(js_isolate, &cls->members_.back());
+
+        v8::Local<v8::FunctionTemplate> getter = v8::FunctionTemplate::New(
+            js_isolate, call_native_getter, data, signature, 0, v8::ConstructorBehavior::kThrow);
+
+        v8::Local<v8::FunctionTemplate> setter;
+        if (accessor.setter)
+        {
+            setter = v8::FunctionTemplate::New(
+                js_isolate, call_native_setter, data, signature, 1, v8::ConstructorBehavior::kThrow);
         }
+
+        prototype->SetAccessorProperty(accessor_name, getter, setter);
     }
 
-    v8::Isolate* isolate = func->script_->isolate_;
+    cls->name_.Reset(js_isolate, name);
+    cls->template_.Reset(js_isolate, tmpl);
 
-    v8::Isolate::Scope isolate_scope(isolate);
+    v8_class* result = cls.get();
 
-    v8::Locker locker(isolate);
+    isolate->classes_.push_back(std::move(cls));
 
-    v8::HandleScope handle_scope(isolate);
+    return result;
+}
 
-    v8::Local<v8::Context> context =
-        v8::Local<v8::Context>::New(isolate, func->script_->context_);
+struct v8_script
+{
+    v8::Isolate* isolate_;
+    v8::Persistent<v8::Context> context_;
+    v8::Persistent<v8::Script> script_;
 
-    v8::Context::Scope context_scope(context);
+    // Set instead of script_ for ES modules
+    v8::Persistent<v8::Module> module_;
+};
 
-    v8::TryCatch try_catch(isolate);
+// Creates a context with host functions and
+// classes of the VM installed
+bool new_script_context(
+    v8_isolate* isolate,
+    v8::Local<v8::Context>* result)
+{
+    v8::Local<v8::Context> context = v8::Context::New(isolate->isolate_);
+
+    context->AllowCodeGenerationFromStrings(false);
+
+    v8::Context::Scope context_scope(context);
 
-    auto args = std::make_unique<v8::Local<v8::Value>[]>(argc);
-    for (int i = 0; i < argc; ++i)
+    for (const auto& function : isolate->host_functions_)
     {
-        args[i] = to_v8_value(context, argv[i]);
+        if (function->global_ &&
+            !install_global(context, function->name_, function->template_))
+        {
+            return false;
+        }
     }
 
-    v8::Local<v8::Function> callable =
-        v8::Local<v8::Function>::New(isolate, func->func_);
-
-    v8::Local<v8::Value> res;
-    if (!callable->Call(context, context->Global(), argc, args.get()).ToLocal(&res))
+    for (const auto& cls : isolate->classes_)
     {
-        make_error(isolate, try_catch, error);
-        return false;
+        if (!install_global(context, cls->name_, cls->template_))
+        {
+            return false;
+        }
     }
 
-    *result = from_v8_value(context, res);
+    *result = context;
+
     return true;
 }
 
-void v8_delete_function(
-    struct v8_callable* func)
+v8_script* v8_compile_script(
+    v8_isolate* isolate,
+    const char* code,
+    const char* location,
+    v8_error* error)
 {
-    assert(func);
+    assert(isolate);
+    assert(code);
+    assert(location);
+    assert(error);
 
-    if (!func)
+    if (!isolate || !code || !location || !error)
     {
-        return;
+        return nullptr;
     }
 
-    func->func_.Reset();
+    clean_error(*error);
 
-    delete func;
+    vm_scope vm(isolate->isolate_);
+
+    v8::HandleScope handle_scope(isolate->isolate_);
+
+    v8::Local<v8::String> code_str;
+    if (!v8::String::NewFromUtf8(
+        isolate->isolate_, code, v8::NewStringType::kInternalized).
+        ToLocal(&code_str))
+    {
+        return nullptr;
+    }
+
+    v8::Local<v8::String> location_str;
+    if (!v8::String::NewFromUtf8(
+        isolate->isolate_, location, v8::NewStringType::kInternalized).
+        ToLocal(&location_str))
+    {
+        return nullptr;
+    }
+
+    v8::ScriptOrigin origin(location_str);
+
+    v8::TryCatch try_catch(isolate->isolate_);
+
+    v8::Local<v8::Context> context;
+    if (!new_script_context(isolate, &context))
+    {
+        make_error(isolate->isolate_, try_catch, error);
+        return nullptr;
+    }
+
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Script> script;
+    if (!v8::Script::Compile(context, code_str, &origin).ToLocal(&script))
+    {
+        make_error(isolate->isolate_, try_catch, error);
+        return nullptr;
+    }
+
+    auto instance = std::make_unique<v8_script>();
+
+    instance->isolate_ = isolate->isolate_;
+    instance->context_.Reset(isolate->isolate_, context);
+    instance->script_.Reset(isolate->isolate_, script);
+
+    return instance.release();
+}
+
+// Runs the script and passes its result to
+// convert(context, value) which returns false and
+// populates the error structure if it fails
+template <class Convert>
+bool run_script(
+    v8_script* script,
+    v8_error* error,
+    Convert convert)
+{
+    assert(script);
+    assert(error);
+
+    if (!script || !error)
+    {
+        return false;
+    }
+
+    clean_error(*error);
+
+    v8::Isolate* isolate = script->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, script->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::TryCatch try_catch(isolate);
+
+    v8::Local<v8::Value> ret_val;
+
+    if (!script->module_.IsEmpty())
+    {
+        v8::Local<v8::Module> module =
+            v8::Local<v8::Module>::New(isolate, script->module_);
+
+        v8::Isolate::SafeForTerminationScope isolate_scope(isolate);
+
+        if (module->Evaluate(context).IsEmpty())
+        {
+            make_error(isolate, try_catch, error);
+            return false;
+        }
+
+        ret_val = module->GetModuleNamespace();
+    }
+    else
+    {
+        v8::Local<v8::Script> compiled_script =
+            v8::Local<v8::Script>::New(isolate, script->script_);
+
+        v8::Isolate::SafeForTerminationScope isolate_scope(isolate);
+
+        if (!compiled_script->Run(context).ToLocal(&ret_val))
+        {
+            make_error(isolate, try_catch, error);
+            return false;
+        }
+    }
+
+    if (!convert(context, ret_val))
+    {
+        make_error(isolate, try_catch, error);
+        return false;
+    }
+
+    return true;
+}
+
+bool v8_run_script(
+    v8_script* script,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(result);
+
+    if (!result)
+    {
+        return false;
+    }
+
+    return run_script(script, error,
+        [result](v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+        {
+            *result = from_v8_value(context, value);
+            return true;
+        });
+}
+
+void v8_terminate_script(
+    v8_script* script)
+{
+    assert(script);
+
+    if (!script)
+    {
+        return;
+    }
+
+    script->isolate_->TerminateExecution();
+}
+
+void v8_delete_script(
+    v8_script* script)
+{
+    assert(script);
+
+    if (!script)
+    {
+        return;
+    }
+
+    script->context_.Reset();
+    script->script_.Reset();
+    script->module_.Reset();
+
+    delete script;
+}
+
+v8::MaybeLocal<v8::Module> compile_module(
+    v8::Isolate* isolate,
+    const char* code,
+    const std::string& location)
+{
+    v8::Local<v8::String> code_str;
+    if (!v8::String::NewFromUtf8(
+        isolate, code, v8::NewStringType::kNormal).ToLocal(&code_str))
+    {
+        return v8::MaybeLocal<v8::Module>();
+    }
+
+    v8::Local<v8::String> location_str;
+    if (!v8::String::NewFromUtf8(isolate, location.c_str(),
+        v8::NewStringType::kInternalized, static_cast<int>(location.size())).
+        ToLocal(&location_str))
+    {
+        return v8::MaybeLocal<v8::Module>();
+    }
+
+    v8::ScriptOrigin origin(location_str,
+        v8::Local<v8::Integer>(), v8::Local<v8::Integer>(),
+        v8::Local<v8::Boolean>(), v8::Local<v8::Integer>(),
+        v8::Local<v8::Value>(), v8::Local<v8::Boolean>(),
+        v8::Local<v8::Boolean>(), v8::True(isolate));
+
+    v8::ScriptCompiler::Source source(code_str, origin);
+
+    return v8::ScriptCompiler::CompileModule(isolate, &source);
+}
+
+// Returns the cached module of the location or
+// compiles the code and caches the module
+bool load_module(
+    v8::Isolate* isolate,
+    module_cache* cache,
+    const std::string& location,
+    const char* code,
+    v8::Local<v8::Module>* result)
+{
+    const auto it = cache->modules_.find(location);
+    if (it != cache->modules_.end())
+    {
+        *result = v8::Local<v8::Module>::New(isolate, it->second);
+        return true;
+    }
+
+    if (!code)
+    {
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
+            isolate, ("No code of module '" + location + "'").c_str(),
+            v8::NewStringType::kNormal).ToLocalChecked()));
+        return false;
+    }
+
+    v8::Local<v8::Module> module;
+    if (!compile_module(isolate, code, location).ToLocal(&module))
+    {
+        return false;
+    }
+
+    cache->modules_.emplace(location, v8::Global<v8::Module>(isolate, module));
+    cache->locations_.emplace(module->GetIdentityHash(), location);
+
+    *result = module;
+
+    return true;
+}
+
+// Modules of a graph which failed to instantiate are
+// uninstantiated again, they are compiled anew next time
+void forget_uninstantiated_modules(
+    v8::Isolate* isolate,
+    module_cache* cache)
+{
+    for (auto it = cache->modules_.begin(); it != cache->modules_.end();)
+    {
+        v8::Local<v8::Module> module = v8::Local<v8::Module>::New(isolate, it->second);
+
+        if (module->GetStatus() != v8::Module::kUninstantiated)
+        {
+            ++it;
+            continue;
+        }
+
+        const auto range = cache->locations_.equal_range(module->GetIdentityHash());
+        for (auto location = range.first; location != range.second; ++location)
+        {
+            if (location->second == it->first)
+            {
+                cache->locations_.erase(location);
+                break;
+            }
+        }
+
+        it = cache->modules_.erase(it);
+    }
+}
+
+const std::string* find_module_location(
+    v8::Isolate* isolate,
+    const module_cache* cache,
+    v8::Local<v8::Module> module)
+{
+    const auto range = cache->locations_.equal_range(module->GetIdentityHash());
+
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        const auto& cached = cache->modules_.at(it->second);
+
+        if (v8::Local<v8::Module>::New(isolate, cached) == module)
+        {
+            return &it->second;
+        }
+    }
+
+    return nullptr;
+}
+
+v8::MaybeLocal<v8::Module> resolve_module(
+    v8::Local<v8::Context> context,
+    v8::Local<v8::String> specifier,
+    v8::Local<v8::Module> referrer)
+{
+    v8::Isolate* isolate = context->GetIsolate();
+
+    module_cache* cache = get_isolate(isolate)->modules_.get();
+
+    const v8::String::Utf8Value specifier_str(isolate, specifier);
+
+    const std::string* referrer_location =
+        find_module_location(isolate, cache, referrer);
+
+    char* location = nullptr;
+    char* code = nullptr;
+
+    const bool found = cache->resolver_ && cache->resolver_(
+        *specifier_str,
+        referrer_location ? referrer_location->c_str() : "",
+        &location,
+        &code,
+        cache->userdata_);
+
+    if (!found || !location)
+    {
+        std::free(location);
+        std::free(code);
+
+        isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
+            isolate, (std::string("Cannot find module '") + *specifier_str + "'").c_str(),
+            v8::NewStringType::kNormal).ToLocalChecked()));
+
+        return v8::MaybeLocal<v8::Module>();
+    }
+
+    const std::string module_location(location);
+
+    std::free(location);
+
+    v8::Local<v8::Module> module;
+    const bool loaded = load_module(isolate, cache, module_location, code, &module);
+
+    std::free(code);
+
+    if (!loaded)
+    {
+        return v8::MaybeLocal<v8::Module>();
+    }
+
+    return module;
+}
+
+module_cache* get_module_cache(
+    v8_isolate* isolate)
+{
+    if (!isolate->modules_)
+    {
+        isolate->modules_ = std::make_unique<module_cache>();
+    }
+
+    return isolate->modules_.get();
+}
+
+void v8_set_module_resolver(
+    v8_isolate* isolate,
+    v8_module_resolver resolver,
+    void* userdata)
+{
+    assert(isolate);
+
+    if (!isolate)
+    {
+        return;
+    }
+
+    module_cache* cache = get_module_cache(isolate);
+
+    cache->resolver_ = resolver;
+    cache->userdata_ = userdata;
+}
+
+v8_script* v8_compile_module(
+    v8_isolate* isolate,
+    const char* code,
+    const char* location,
+    v8_error* error)
+{
+    assert(isolate);
+    assert(code);
+    assert(location);
+    assert(error);
+
+    if (!isolate || !code || !location || !error)
+    {
+        return nullptr;
+    }
+
+    clean_error(*error);
+
+    vm_scope vm(isolate->isolate_);
+
+    v8::HandleScope handle_scope(isolate->isolate_);
+
+    v8::TryCatch try_catch(isolate->isolate_);
+
+    module_cache* cache = get_module_cache(isolate);
+
+    v8::Local<v8::Context> context;
+    if (cache->context_.IsEmpty())
+    {
+        if (!new_script_context(isolate, &context))
+        {
+            make_error(isolate->isolate_, try_catch, error);
+            return nullptr;
+        }
+
+        cache->context_.Reset(isolate->isolate_, context);
+    }
+    else
+    {
+        context = v8::Local<v8::Context>::New(isolate->isolate_, cache->context_);
+    }
+
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Module> module;
+    if (!load_module(isolate->isolate_, cache, location, code, &module))
+    {
+        make_error(isolate->isolate_, try_catch, error);
+        return nullptr;
+    }
+
+    if (!module->InstantiateModule(context, resolve_module).FromMaybe(false))
+    {
+        forget_uninstantiated_modules(isolate->isolate_, cache);
+
+        make_error(isolate->isolate_, try_catch, error);
+        return nullptr;
+    }
+
+    auto instance = std::make_unique<v8_script>();
+
+    instance->isolate_ = isolate->isolate_;
+    instance->context_.Reset(isolate->isolate_, context);
+    instance->module_.Reset(isolate->isolate_, module);
+
+    return instance.release();
+}
+
+bool v8_register_script_function(
+    v8_script* script,
+    const char* name,
+    v8_host_callback callback,
+    void* userdata)
+{
+    assert(script);
+    assert(name);
+    assert(callback);
+
+    if (!script || !name || !callback)
+    {
+        return false;
+    }
+
+    v8::Isolate* isolate = script->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, script->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    auto function = new_host_function(isolate, name, call_host_function, 0);
+    if (!function)
+    {
+        return false;
+    }
+
+    function->callback_ = callback;
+    function->userdata_ = userdata;
+
+    if (!install_global(context, function->name_, function->template_))
+    {
+        return false;
+    }
+
+    get_isolate(isolate)->host_functions_.push_back(std::move(function));
+
+    return true;
+}
+
+struct v8_callable
+{
+    v8::Isolate* isolate_;
+    v8::Persistent<v8::Context> context_;
+    v8::Persistent<v8::Function> func_;
+
+    // this of calls
+    v8::Persistent<v8::Value> receiver_;
+
+    // Arguments of calls with more than small_args_count
+    // arguments, the buffer grows and is reused by calls
+    std::vector<v8::Local<v8::Value>> args_;
+    bool args_in_use_ = false;
+};
+
+// Storage for converted arguments of one call. Small calls keep
+// arguments in place, larger ones use the buffer of the function.
+// If the function is called again while its buffer is in use
+// (from JS through a host function) a new buffer is allocated
+class call_args
+{
+public:
+    call_args(v8_callable* func, int argc)
+        : func_(nullptr)
+        , data_(small_)
+    {
+        if (argc <= small_args_count)
+        {
+            return;
+        }
+
+        if (func->args_in_use_)
+        {
+            own_.resize(static_cast<size_t>(argc));
+            data_ = own_.data();
+            return;
+        }
+
+        func_ = func;
+        func_->args_in_use_ = true;
+
+        if (func_->args_.size() < static_cast<size_t>(argc))
+        {
+            func_->args_.resize(static_cast<size_t>(argc));
+        }
+
+        data_ = func_->args_.data();
+    }
+
+    ~call_args()
+    {
+        if (func_)
+        {
+            func_->args_in_use_ = false;
+        }
+    }
+
+    call_args(const call_args&) = delete;
+    call_args& operator=(const call_args&) = delete;
+
+    v8::Local<v8::Value>* data()
+    {
+        return data_;
+    }
+
+private:
+    v8_callable* func_;
+    v8::Local<v8::Value>* data_;
+    v8::Local<v8::Value> small_[small_args_count];
+    std::vector<v8::Local<v8::Value>> own_;
+};
+
+std::unique_ptr<v8_callable> new_callable(
+    v8::Local<v8::Context> context,
+    v8::Local<v8::Value> func,
+    v8::Local<v8::Value> receiver)
+{
+    if (!func->IsFunction())
+    {
+        return nullptr;
+    }
+
+    v8::Isolate* isolate = context->GetIsolate();
+
+    auto instance = std::make_unique<v8_callable>();
+
+    instance->isolate_ = isolate;
+    instance->context_.Reset(isolate, context);
+    instance->func_.Reset(isolate, v8::Local<v8::Function>::Cast(func));
+    instance->receiver_.Reset(isolate, receiver);
+
+    return instance;
+}
+
+v8_callable* v8_get_function(
+    struct v8_script* script,
+    const char* name)
+{
+    assert(script);
+    assert(name);
+
+    if (!script || !name)
+    {
+        return nullptr;
+    }
+
+    vm_scope vm(script->isolate_);
+
+    v8::HandleScope handle_scope(script->isolate_);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(script->isolate_, script->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::TryCatch try_catch(script->isolate_);
+
+    // Each name of the path is looked up in the object
+    // selected by the previous one, which becomes this.
+    // Names of modules are looked up in their exports
+    v8::Local<v8::Value> receiver;
+    v8::Local<v8::Value> func = context->Global();
+
+    v8::Local<v8::Value> exports;
+    if (!script->module_.IsEmpty())
+    {
+        exports = v8::Local<v8::Module>::New(
+            script->isolate_, script->module_)->GetModuleNamespace();
+        func = exports;
+    }
+
+    const char* begin = name;
+    for (;;)
+    {
+        const char* end = std::strchr(begin, '.');
+
+        const size_t length = end
+            ? static_cast<size_t>(end - begin)
+            : std::strlen(begin);
+
+        v8::Local<v8::String> func_name;
+        if (!func->IsObject() || !v8::String::NewFromUtf8(
+            script->isolate_, begin, v8::NewStringType::kNormal,
+            static_cast<int>(length)).ToLocal(&func_name))
+        {
+            return nullptr;
+        }
+
+        receiver = func;
+
+        if (!v8::Local<v8::Object>::Cast(receiver)->Get(context, func_name).ToLocal(&func))
+        {
+            return nullptr;
+        }
+
+        if (!end)
+        {
+            break;
+        }
+
+        begin = end + 1;
+    }
+
+    // Exported functions are called without this
+    if (!exports.IsEmpty() && receiver == exports)
+    {
+        receiver = v8::Undefined(script->isolate_);
+    }
+
+    return new_callable(context, func, receiver).release();
+}
+
+v8_callable* v8_get_method(
+    v8_value handle,
+    const char* name)
+{
+    js_handle* impl = to_js_handle(handle);
+
+    assert(impl);
+    assert(name);
+
+    if (!impl || !name)
+    {
+        return nullptr;
+    }
+
+    v8::Isolate* isolate = impl->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, impl->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::TryCatch try_catch(isolate);
+
+    v8::Local<v8::String> func_name;
+    if (!v8::String::NewFromUtf8(
+        isolate, name, v8::NewStringType::kNormal).ToLocal(&func_name))
+    {
+        return nullptr;
+    }
+
+    v8::Local<v8::Object> object =
+        v8::Local<v8::Value>::New(isolate, impl->value_).As<v8::Object>();
+
+    v8::Local<v8::Value> func;
+    if (!object->Get(context, func_name).ToLocal(&func))
+    {
+        return nullptr;
+    }
+
+    return new_callable(context, func, object).release();
+}
+
+v8_callable* v8_get_callable(
+    v8_value handle)
+{
+    js_handle* impl = to_js_handle(handle);
+
+    assert(impl);
+
+    if (!impl)
+    {
+        return nullptr;
+    }
+
+    v8::Isolate* isolate = impl->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, impl->context_);
+
+    return new_callable(context,
+        v8::Local<v8::Value>::New(isolate, impl->value_),
+        v8::Undefined(isolate)).release();
+}
+
+// Calls the function and passes its result to
+// convert(context, value) which returns false and
+// populates the error structure if it fails
+template <class Convert>
+bool call_function(
+    v8_callable* func,
+    int argc,
+    v8_value* argv,
+    v8_error* error,
+    Convert convert)
+{
+    assert(func);
+    assert(error);
+
+    if (!func || !error)
+    {
+        return false;
+    }
+
+    assert(argc >= 0);
+
+    if (argc < 0)
+    {
+        return false;
+    }
+    else if (argc == 0)
+    {
+        assert(!argv);
+
+        if (argv)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        assert(argv);
+
+        if (!argv)
+        {
+            return false;
+        }
+    }
+
+    clean_error(*error);
+
+    v8::Isolate* isolate = func->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, func->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::TryCatch try_catch(isolate);
+
+    call_args args(func, argc);
+    to_v8_values(context, argc, argv, args.data());
+
+    v8::Local<v8::Function> callable =
+        v8::Local<v8::Function>::New(isolate, func->func_);
+
+    v8::Local<v8::Value> receiver =
+        v8::Local<v8::Value>::New(isolate, func->receiver_);
+
+    v8::Local<v8::Value> res;
+    if (!callable->Call(context, receiver, argc, args.data()).ToLocal(&res))
+    {
+        make_error(isolate, try_catch, error);
+        return false;
+    }
+
+    if (!convert(context, res))
+    {
+        make_error(isolate, try_catch, error);
+        return false;
+    }
+
+    return true;
+}
+
+bool v8_call_function(
+    v8_callable* func,
+    int argc,
+    v8_value* argv,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(result);
+
+    if (!result)
+    {
+        return false;
+    }
+
+    return call_function(func, argc, argv, error,
+        [result](v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+        {
+            *result = from_v8_value(context, value);
+            return true;
+        });
+}
+
+bool v8_call_function_batch(
+    v8_callable* func,
+    int count,
+    int argc,
+    v8_value* argv,
+    v8_value* results,
+    v8_error* errors)
+{
+    assert(func);
+    assert(count >= 0);
+    assert(argc >= 0);
+    assert(results || count == 0);
+    assert(errors || count == 0);
+
+    if (!func || count < 0 || argc < 0
+        || ((!results || !errors) && count > 0))
+    {
+        return false;
+    }
+
+    assert(argv || argc == 0 || count == 0);
+
+    if (!argv && argc > 0 && count > 0)
+    {
+        return false;
+    }
+
+    v8::Isolate* isolate = func->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, func->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Function> callable =
+        v8::Local<v8::Function>::New(isolate, func->func_);
+
+    v8::Local<v8::Value> receiver =
+        v8::Local<v8::Value>::New(isolate, func->receiver_);
+
+    call_args args(func, argc);
+
+    bool ok = true;
+    bool terminated = false;
+
+    for (int i = 0; i < count; ++i)
+    {
+        clean_error(errors[i]);
+
+        if (terminated)
+        {
+            results[i] = v8_new_undefined();
+            errors[i].message = duplicate_string("Script execution terminated");
+            continue;
+        }
+
+        v8::HandleScope call_scope(isolate);
+
+        v8::TryCatch try_catch(isolate);
+
+        to_v8_values(context, argc, argv + static_cast<ptrdiff_t>(i) * argc, args.data());
+
+        v8::Local<v8::Value> res;
+        bool called;
+
+        {
+            v8::Isolate::SafeForTerminationScope isolate_scope(isolate);
+            called = callable->Call(context, receiver, argc, args.data()).ToLocal(&res);
+        }
+
+        if (!called)
+        {
+            // Termination is over once the call returns, so it
+            // is remembered to skip the remaining calls
+            terminated = try_catch.HasTerminated();
+
+            make_error(isolate, try_catch, &errors[i]);
+            results[i] = v8_new_undefined();
+            ok = false;
+            continue;
+        }
+
+        results[i] = from_v8_value(context, res);
+    }
+
+    return ok;
+}
+
+void v8_delete_function(
+    struct v8_callable* func)
+{
+    assert(func);
+
+    if (!func)
+    {
+        return;
+    }
+
+    func->context_.Reset();
+    func->func_.Reset();
+    func->receiver_.Reset();
+
+    delete func;
+}
+
+void settle_promise(
+    const v8::FunctionCallbackInfo<v8::Value>& info,
+    int state)
+{
+    auto* promise = static_cast<v8_promise*>(info.Data().As<v8::External>()->Value());
+
+    get_isolate(info.GetIsolate())->promises_.erase(promise);
+
+    promise->state_ = state;
+
+    if (promise->deleted_)
+    {
+        --get_isolate(info.GetIsolate())->deleted_promises_;
+        delete promise;
+        return;
+    }
+
+    if (promise->callback_)
+    {
+        v8_value value = from_v8_value(info.GetIsolate()->GetCurrentContext(), info[0]);
+
+        // The callback may delete the promise
+        promise->callback_(promise, &value, promise->userdata_);
+
+        v8_delete_value(&value);
+    }
+}
+
+void on_promise_fulfilled(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
+{
+    settle_promise(info, v8_promise_fulfilled);
+}
+
+void on_promise_rejected(
+    const v8::FunctionCallbackInfo<v8::Value>& info)
+{
+    settle_promise(info, v8_promise_rejected);
+}
+
+// Wraps the value into a promise if it is not one and
+// attaches reactions which settle the result
+bool watch_promise(
+    v8::Local<v8::Context> context,
+    v8::Local<v8::Value> value,
+    v8_promise_callback callback,
+    void* userdata,
+    v8_promise** result)
+{
+    v8::Isolate* isolate = context->GetIsolate();
+
+    // Reactions must not run before the promise is returned
+    v8::Isolate::SuppressMicrotaskExecutionScope suppress_microtasks(isolate);
+
+    v8::Local<v8::Promise> js_promise;
+    if (value->IsPromise())
+    {
+        js_promise = v8::Local<v8::Promise>::Cast(value);
+    }
+    else
+    {
+        v8::Local<v8::Promise::Resolver> resolver;
+        if (!v8::Promise::Resolver::New(context).ToLocal(&resolver)
+            || resolver->Resolve(context, value).IsNothing())
+        {
+            return false;
+        }
+
+        js_promise = resolver->GetPromise();
+    }
+
+    auto promise = std::make_unique<v8_promise>();
+
+    promise->isolate_ = isolate;
+    promise->context_.Reset(isolate, context);
+    promise->promise_.Reset(isolate, js_promise);
+    promise->callback_ = callback;
+    promise->userdata_ = userdata;
+
+    v8::Local<v8::External> data = v8::External::New(isolate, promise.get());
+
+    v8::Local<v8::Function> on_fulfilled;
+    v8::Local<v8::Function> on_rejected;
+    if (!v8::Function::New(context, on_promise_fulfilled, data, 1,
+            v8::ConstructorBehavior::kThrow).ToLocal(&on_fulfilled)
+        || !v8::Function::New(context, on_promise_rejected, data, 1,
+            v8::ConstructorBehavior::kThrow).ToLocal(&on_rejected)
+        || js_promise->Then(context, on_fulfilled, on_rejected).IsEmpty())
+    {
+        return false;
+    }
+
+    get_isolate(isolate)->promises_.insert(promise.get());
+
+    *result = promise.release();
+
+    return true;
+}
+
+v8_promise* v8_call_function_async(
+    v8_callable* func,
+    int argc,
+    v8_value* argv,
+    v8_promise_callback callback,
+    void* userdata,
+    v8_error* error)
+{
+    v8_promise* result = nullptr;
+
+    call_function(func, argc, argv, error,
+        [callback, userdata, &result](
+            v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+        {
+            return watch_promise(context, value, callback, userdata, &result);
+        });
+
+    return result;
+}
+
+int v8_promise_state(
+    const v8_promise* promise)
+{
+    assert(promise);
+
+    if (!promise)
+    {
+        return v8_promise_pending;
+    }
+
+    return promise->state_;
+}
+
+bool v8_promise_result(
+    v8_promise* promise,
+    v8_value* result)
+{
+    assert(promise);
+    assert(result);
+
+    if (!promise || !result || promise->state_ == v8_promise_pending)
+    {
+        return false;
+    }
+
+    v8::Isolate* isolate = promise->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, promise->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    *result = from_v8_value(context,
+        v8::Local<v8::Promise>::New(isolate, promise->promise_)->Result());
+
+    return true;
+}
+
+void v8_delete_promise(
+    v8_promise* promise)
+{
+    assert(promise);
+
+    if (!promise)
+    {
+        return;
+    }
+
+    promise->context_.Reset();
+    promise->promise_.Reset();
+
+    if (promise->state_ == v8_promise_pending)
+    {
+        promise->deleted_ = true;
+        ++get_isolate(promise->isolate_)->deleted_promises_;
+        return;
+    }
+
+    delete promise;
+}
+
+void v8_run_microtasks(
+    v8_isolate* isolate)
+{
+    assert(isolate);
+
+    if (!isolate)
+    {
+        return;
+    }
+
+    vm_scope vm(isolate->isolate_);
+
+    v8::HandleScope handle_scope(isolate->isolate_);
+
+    isolate->isolate_->PerformMicrotaskCheckpoint();
+}
+
+int v8_poll(
+    v8_isolate* isolate)
+{
+    assert(isolate);
+
+    if (!isolate)
+    {
+        return 0;
+    }
+
+    if (current_platform)
+    {
+        vm_scope vm(isolate->isolate_);
+
+        // E.g. finalizers of collected native objects
+        while (v8::platform::PumpMessageLoop(current_platform, isolate->isolate_))
+        {
+        }
+    }
+
+    v8_run_microtasks(isolate);
+
+    return static_cast<int>(isolate->promises_.size()) - isolate->deleted_promises_;
+}
+
+struct v8_path
+{
+    enum class step_kind
+    {
+        property,
+        index,
+        wildcard
+    };
+
+    struct step
+    {
+        step_kind kind_;
+        std::string name_;
+        uint32_t index_;
+    };
+
+    std::vector<step> steps_;
+    bool has_wildcards_ = false;
+};
+
+bool parse_path_index(
+    const char*& pos,
+    v8_path::step& step)
+{
+    if (*pos == '*')
+    {
+        step.kind_ = v8_path::step_kind::wildcard;
+        ++pos;
+    }
+    else if (*pos == '"' || *pos == '\'')
+    {
+        const char quote = *pos++;
+        const char* end = std::strchr(pos, quote);
+        if (!end)
+        {
+            return false;
+        }
+        step.kind_ = v8_path::step_kind::property;
+        step.name_.assign(pos, end);
+        pos = end + 1;
+    }
+    else if (*pos >= '0' && *pos <= '9')
+    {
+        uint64_t index = 0;
+        for (; *pos >= '0' && *pos <= '9'; ++pos)
+        {
+            index = index * 10 + static_cast<uint64_t>(*pos - '0');
+            if (index > std::numeric_limits<uint32_t>::max())
+            {
+                return false;
+            }
+        }
+        step.kind_ = v8_path::step_kind::index;
+        step.index_ = static_cast<uint32_t>(index);
+    }
+    else
+    {
+        return false;
+    }
+
+    return *pos++ == ']';
+}
+
+bool parse_path_name(
+    const char*& pos,
+    v8_path::step& step)
+{
+    if (*pos == '*')
+    {
+        step.kind_ = v8_path::step_kind::wildcard;
+        ++pos;
+        return true;
+    }
+
+    const char* begin = pos;
+    while (*pos && *pos != '.' && *pos != '[')
+    {
+        ++pos;
+    }
+
+    if (pos == begin)
+    {
+        return false;
+    }
+
+    step.kind_ = v8_path::step_kind::property;
+    step.name_.assign(begin, pos);
+    return true;
+}
+
+v8_path* v8_compile_path(
+    const char* path)
+{
+    assert(path);
+
+    if (!path)
+    {
+        return nullptr;
+    }
+
+    auto instance = std::make_unique<v8_path>();
+
+    const char* pos = path;
+
+    while (*pos)
+    {
+        v8_path::step step = { v8_path::step_kind::property, std::string(), 0 };
+
+        bool ok = false;
+
+        if (*pos == '[')
+        {
+            ++pos;
+            ok = parse_path_index(pos, step);
+        }
+        else if (*pos == '.' && !instance->steps_.empty())
+        {
+            ++pos;
+            ok = parse_path_name(pos, step);
+        }
+        else if (instance->steps_.empty())
+        {
+            ok = parse_path_name(pos, step);
+        }
+
+        if (!ok)
+        {
+            return nullptr;
+        }
+
+        if (step.kind_ == v8_path::step_kind::wildcard)
+        {
+            instance->has_wildcards_ = true;
+        }
+
+        instance->steps_.push_back(std::move(step));
+    }
+
+    return instance.release();
+}
+
+void v8_delete_path(
+    v8_path* path)
+{
+    assert(path);
+
+    if (!path)
+    {
+        return;
+    }
+
+    delete path;
+}
+
+// Walks the value along the path starting from the step
+// and appends selected values. Missing parts of the path
+// select undefined if there are no wildcards and nothing
+// otherwise. Returns false if JS throws
+bool select_path(
+    v8::Local<v8::Context> context,
+    const v8_path& path,
+    size_t step,
+    v8::Local<v8::Value> value,
+    std::vector<v8::Local<v8::Value>>& selected)
+{
+    for (; step < path.steps_.size(); ++step)
+    {
+        if (!value->IsObject())
+        {
+            if (!path.has_wildcards_)
+            {
+                selected.push_back(v8::Undefined(context->GetIsolate()));
+            }
+            return true;
+        }
+
+        v8::Local<v8::Object> object = value.As<v8::Object>();
+
+        const auto& current = path.steps_[step];
+
+        switch (current.kind_)
+        {
+        case v8_path::step_kind::property:
+        {
+            v8::Local<v8::String> name;
+            if (!v8::String::NewFromUtf8(context->GetIsolate(),
+                current.name_.c_str(),
+                v8::NewStringType::kInternalized,
+                static_cast<int>(current.name_.size())).ToLocal(&name))
+            {
+                return false;
+            }
+
+            if (!object->Get(context, name).ToLocal(&value))
+            {
+                return false;
+            }
+            break;
+        }
+        case v8_path::step_kind::index:
+            if (!object->Get(context, current.index_).ToLocal(&value))
+            {
+                return false;
+            }
+            break;
+        case v8_path::step_kind::wildcard:
+        {
+            if (object->IsArray())
+            {
+                const uint32_t length = object.As<v8::Array>()->Length();
+                for (uint32_t i = 0; i < length; ++i)
+                {
+                    v8::Local<v8::Value> elem;
+                    if (!object->Get(context, i).ToLocal(&elem)
+                        || !select_path(context, path, step + 1, elem, selected))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            v8::Local<v8::Array> keys;
+            if (!object->GetOwnPropertyNames(context).ToLocal(&keys))
+            {
+                return false;
+            }
+
+            const uint32_t length = keys->Length();
+            for (uint32_t i = 0; i < length; ++i)
+            {
+                v8::Local<v8::Value> key;
+                v8::Local<v8::Value> elem;
+                if (!keys->Get(context, i).ToLocal(&key)
+                    || !object->Get(context, key).ToLocal(&elem)
+                    || !select_path(context, path, step + 1, elem, selected))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        }
+    }
+
+    selected.push_back(value);
+    return true;
+}
+
+bool convert_selected(
+    v8::Local<v8::Context> context,
+    const v8_path& path,
+    v8::Local<v8::Value> value,
+    v8_value* result)
+{
+    std::vector<v8::Local<v8::Value>> selected;
+
+    if (!select_path(context, path, 0, value, selected))
+    {
+        return false;
+    }
+
+    if (!path.has_wildcards_)
+    {
+        assert(selected.size() == 1);
+        *result = from_v8_value(context, selected.front());
+        return true;
+    }
+
+    *result = v8_new_array(static_cast<int32_t>(selected.size()));
+
+    auto data = v8_to_array(*result).data;
+    for (size_t i = 0; i < selected.size(); ++i)
+    {
+        data[i] = from_v8_value(context, selected[i]);
+    }
+
+    return true;
+}
+
+bool v8_run_script_select(
+    v8_script* script,
+    const v8_path* path,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(path);
+    assert(result);
+
+    if (!path || !result)
+    {
+        return false;
+    }
+
+    return run_script(script, error,
+        [path, result](v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+        {
+            return convert_selected(context, *path, value, result);
+        });
+}
+
+bool v8_call_function_select(
+    v8_callable* func,
+    int argc,
+    v8_value* argv,
+    const v8_path* path,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(path);
+    assert(result);
+
+    if (!path || !result)
+    {
+        return false;
+    }
+
+    return call_function(func, argc, argv, error,
+        [path, result](v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+        {
+            return convert_selected(context, *path, value, result);
+        });
+}
+
+// Enters the VM and the context and calls func(context)
+// which returns false if JS throws
+template <class Func>
+bool in_context(
+    v8::Isolate* isolate,
+    const v8::Persistent<v8::Context>& persistent_context,
+    v8_error* error,
+    Func func)
+{
+    assert(error);
+
+    if (!error)
+    {
+        return false;
+    }
+
+    clean_error(*error);
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, persistent_context);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::TryCatch try_catch(isolate);
+
+    if (!func(context))
+    {
+        make_error(isolate, try_catch, error);
+        return false;
+    }
+
+    return true;
+}
+
+template <class Func>
+bool in_script_context(
+    v8_script* script,
+    v8_error* error,
+    Func func)
+{
+    assert(script);
+
+    if (!script)
+    {
+        return false;
+    }
+
+    return in_context(script->isolate_, script->context_, error, func);
+}
+
+bool v8_set_global(
+    v8_script* script,
+    const char* name,
+    v8_value value,
+    v8_error* error)
+{
+    assert(name);
+
+    if (!name)
+    {
+        return false;
+    }
+
+    return in_script_context(script, error,
+        [name, value](v8::Local<v8::Context> context)
+        {
+            v8::Local<v8::String> key;
+            if (!v8::String::NewFromUtf8(context->GetIsolate(),
+                name, v8::NewStringType::kInternalized).ToLocal(&key))
+            {
+                return false;
+            }
+
+            return context->Global()->Set(
+                context, key, to_v8_value(context, value)).FromMaybe(false);
+        });
+}
+
+bool v8_get_global(
+    v8_script* script,
+    const char* name,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(name);
+    assert(result);
+
+    if (!name || !result)
+    {
+        return false;
+    }
+
+    return in_script_context(script, error,
+        [name, result](v8::Local<v8::Context> context)
+        {
+            v8::Local<v8::String> key;
+            if (!v8::String::NewFromUtf8(context->GetIsolate(),
+                name, v8::NewStringType::kInternalized).ToLocal(&key))
+            {
+                return false;
+            }
+
+            v8::Local<v8::Value> value;
+            if (!context->Global()->Get(context, key).ToLocal(&value))
+            {
+                return false;
+            }
+
+            *result = from_v8_value(context, value);
+
+            return true;
+        });
+}
+
+struct v8_channel
+{
+    // The buffer is freed when neither the channel
+    // nor a SharedArrayBuffer refers to it
+    std::shared_ptr<v8::BackingStore> store_;
+    uint8_t* records_;
+    std::atomic<int32_t>* head_;
+    std::atomic<int32_t>* tail_;
+    int32_t record_size_;
+    int32_t capacity_;
+};
+
+void free_channel_buffer(
+    void* data,
+    size_t,
+    void*)
+{
+    std::free(data);
+}
+
+v8_channel* v8_new_channel(
+    int32_t record_size,
+    int32_t capacity)
+{
+    assert(record_size > 0);
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+    if (record_size <= 0 || capacity <= 0 || (capacity & (capacity - 1)) != 0)
+    {
+        return nullptr;
+    }
+
+    const size_t size = v8_channel_records_offset
+        + static_cast<size_t>(record_size) * static_cast<size_t>(capacity);
+
+    auto data = static_cast<uint8_t*>(std::calloc(size, 1));
+    if (!data)
+    {
+        return nullptr;
+    }
+
+    auto channel = std::make_unique<v8_channel>();
+
+    channel->store_ = v8::SharedArrayBuffer::NewBackingStore(
+        data, size, free_channel_buffer, nullptr);
+
+    channel->records_ = data + v8_channel_records_offset;
+    channel->head_ = new (data + v8_channel_head_offset) std::atomic<int32_t>(0);
+    channel->tail_ = new (data + v8_channel_tail_offset) std::atomic<int32_t>(0);
+    channel->record_size_ = record_size;
+    channel->capacity_ = capacity;
+
+    std::memcpy(data + v8_channel_record_size_offset, &record_size, sizeof(record_size));
+    std::memcpy(data + v8_channel_capacity_offset, &capacity, sizeof(capacity));
+
+    return channel.release();
+}
+
+// Counters wrap around, the capacity is a power of two,
+// so the slot of a counter doesn't change on a wrap
+bool v8_channel_write(
+    v8_channel* channel,
+    const void* record)
+{
+    assert(channel);
+    assert(record);
+
+    if (!channel || !record)
+    {
+        return false;
+    }
+
+    const auto head = static_cast<uint32_t>(channel->head_->load(std::memory_order_relaxed));
+    const auto tail = static_cast<uint32_t>(channel->tail_->load(std::memory_order_acquire));
+
+    if (head - tail >= static_cast<uint32_t>(channel->capacity_))
+    {
+        return false;
+    }
+
+    const uint32_t slot = head & static_cast<uint32_t>(channel->capacity_ - 1);
+
+    std::memcpy(
+        channel->records_ + static_cast<size_t>(slot) * static_cast<size_t>(channel->record_size_),
+        record,
+        static_cast<size_t>(channel->record_size_));
+
+    channel->head_->store(static_cast<int32_t>(head + 1), std::memory_order_release);
+
+    return true;
+}
+
+int32_t v8_channel_size(
+    const v8_channel* channel)
+{
+    assert(channel);
+
+    if (!channel)
+    {
+        return 0;
+    }
+
+    const auto head = static_cast<uint32_t>(channel->head_->load(std::memory_order_acquire));
+    const auto tail = static_cast<uint32_t>(channel->tail_->load(std::memory_order_acquire));
+
+    return static_cast<int32_t>(head - tail);
+}
+
+bool v8_attach_channel(
+    v8_script* script,
+    const char* name,
+    v8_channel* channel,
+    v8_error* error)
+{
+    assert(name);
+    assert(channel);
+
+    if (!name || !channel)
+    {
+        return false;
+    }
+
+    return in_script_context(script, error,
+        [name, channel](v8::Local<v8::Context> context)
+        {
+            v8::Isolate* isolate = context->GetIsolate();
+
+            v8::Local<v8::String> key;
+            if (!v8::String::NewFromUtf8(
+                isolate, name, v8::NewStringType::kInternalized).ToLocal(&key))
+            {
+                return false;
+            }
+
+            return context->Global()->Set(context, key,
+                v8::SharedArrayBuffer::New(isolate, channel->store_)).FromMaybe(false);
+        });
+}
+
+void v8_delete_channel(
+    v8_channel* channel)
+{
+    assert(channel);
+
+    if (!channel)
+    {
+        return;
+    }
+
+    delete channel;
+}
+
+bool v8_new_native_object(
+    v8_script* script,
+    v8_class* cls,
+    void* self,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(cls);
+    assert(self);
+    assert(result);
+
+    if (!cls || !self || !result)
+    {
+        return false;
+    }
+
+    return in_script_context(script, error,
+        [cls, self, result](v8::Local<v8::Context> context)
+        {
+            v8::Isolate* isolate = context->GetIsolate();
+
+            v8::Local<v8::Object> object;
+            if (!v8::Local<v8::FunctionTemplate>::New(isolate, cls->template_)->
+                InstanceTemplate()->NewInstance(context).ToLocal(&object))
+            {
+                return false;
+            }
+
+            if (!attach_native_object(isolate, cls, object, self))
+            {
+                return false;
+            }
+
+            *result = from_v8_value(context, object, v8_convert_to_handles);
+
+            return true;
+        });
+}
+
+void* v8_get_native_object(
+    v8_value handle,
+    v8_class* cls)
+{
+    assert(cls);
+
+    js_handle* impl = to_js_handle(handle);
+
+    if (!impl || !cls)
+    {
+        return nullptr;
+    }
+
+    v8::Isolate* isolate = impl->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Value> value = v8::Local<v8::Value>::New(isolate, impl->value_);
+
+    if (!v8::Local<v8::FunctionTemplate>::New(isolate, cls->template_)->HasInstance(value))
+    {
+        return nullptr;
+    }
+
+    return get_native_self(v8::Local<v8::Object>::Cast(value));
+}
+
+bool write_json(
+    v8::Isolate* isolate,
+    v8::Local<v8::String> json,
+    v8_json_buffer* buffer)
+{
+    const int length = json->Utf8Length(isolate);
+
+    if (length >= buffer->capacity || !buffer->data)
+    {
+        int32_t capacity = buffer->capacity > 0 ? buffer->capacity : 64;
+        while (capacity <= length)
+        {
+            capacity = capacity < std::numeric_limits<int32_t>::max() / 2
+                ? capacity * 2
+                : std::numeric_limits<int32_t>::max();
+        }
+
+        void* data = std::realloc(buffer->data, static_cast<size_t>(capacity));
+        if (!data)
+        {
+            return false;
+        }
+
+        buffer->data = static_cast<char*>(data);
+        buffer->capacity = capacity;
+    }
+
+    json->WriteUtf8(isolate, buffer->data, buffer->capacity, nullptr,
+        v8::String::REPLACE_INVALID_UTF8);
+
+    buffer->size = length;
+
+    return true;
+}
+
+bool v8_call_function_json(
+    v8_callable* func,
+    const char* json_args,
+    int32_t length,
+    v8_json_buffer* result,
+    v8_error* error)
+{
+    assert(func);
+    assert(json_args);
+    assert(length >= 0);
+    assert(result);
+
+    if (!func || !json_args || length < 0 || !result)
+    {
+        return false;
+    }
+
+    return in_context(func->isolate_, func->context_, error,
+        [func, json_args, length, result](v8::Local<v8::Context> context)
+        {
+            v8::Isolate* isolate = context->GetIsolate();
+
+            v8::Local<v8::String> json_string;
+            if (!v8::String::NewFromUtf8(isolate, json_args,
+                v8::NewStringType::kNormal, length).ToLocal(&json_string))
+            {
+                return false;
+            }
+
+            v8::Local<v8::Value> parsed;
+            if (!v8::JSON::Parse(context, json_string).ToLocal(&parsed))
+            {
+                return false;
+            }
+
+            if (!parsed->IsArray())
+            {
+                isolate->ThrowException(v8::Exception::TypeError(
+                    v8::String::NewFromUtf8(isolate, "Arguments must be a JSON array",
+                        v8::NewStringType::kNormal).ToLocalChecked()));
+                return false;
+            }
+
+            v8::Local<v8::Array> arr = parsed.As<v8::Array>();
+
+            const int argc = static_cast<int>(arr->Length());
+
+            call_args args(func, argc);
+            for (int i = 0; i < argc; ++i)
+            {
+                if (!arr->Get(context, static_cast<uint32_t>(i)).ToLocal(&args.data()[i]))
+                {
+                    return false;
+                }
+            }
+
+            v8::Local<v8::Function> callable =
+                v8::Local<v8::Function>::New(isolate, func->func_);
+
+            v8::Local<v8::Value> receiver =
+                v8::Local<v8::Value>::New(isolate, func->receiver_);
+
+            v8::Local<v8::Value> res;
+            if (!callable->Call(context, receiver, argc, args.data()).ToLocal(&res))
+            {
+                return false;
+            }
+
+            v8::Local<v8::String> json;
+            if (!v8::JSON::Stringify(context, res).ToLocal(&json))
+            {
+                return false;
+            }
+
+            if (!write_json(isolate, json, result))
+            {
+                isolate->ThrowException(v8::Exception::RangeError(
+                    v8::String::NewFromUtf8(isolate, "Unable to grow the result buffer",
+                        v8::NewStringType::kNormal).ToLocalChecked()));
+                return false;
+            }
+
+            return true;
+        });
+}
+
+void v8_delete_json_buffer(
+    v8_json_buffer* buffer)
+{
+    assert(buffer);
+
+    if (!buffer)
+    {
+        return;
+    }
+
+    std::free(buffer->data);
+
+    buffer->data = nullptr;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+using backing_stores = std::vector<std::shared_ptr<v8::BackingStore>>;
+
+// Tag of a serialized data view, typed arrays are
+// tagged with their v8_value type
+const uint32_t data_view_tag = 0;
+
+uint32_t get_array_buffer_view_tag(
+    v8::Local<v8::ArrayBufferView> view)
+{
+    if (view->IsUint8Array()) return v8_uint8_array;
+    if (view->IsFloat64Array()) return v8_float64_array;
+    if (view->IsFloat32Array()) return v8_float32_array;
+    if (view->IsInt32Array()) return v8_int32_array;
+    if (view->IsUint32Array()) return v8_uint32_array;
+    if (view->IsInt8Array()) return v8_int8_array;
+    if (view->IsUint8ClampedArray()) return v8_uint8_clamped_array;
+    if (view->IsInt16Array()) return v8_int16_array;
+    if (view->IsUint16Array()) return v8_uint16_array;
+    if (view->IsBigInt64Array()) return v8_big_int64_array;
+    if (view->IsBigUint64Array()) return v8_big_uint64_array;
+    return data_view_tag;
+}
+
+// Writes array buffer views as a reference to a backing
+// store which is moved along with the serialized data
+class serializer_delegate
+    : public v8::ValueSerializer::Delegate
+{
+public:
+    explicit serializer_delegate(v8::Isolate* isolate)
+        : isolate_(isolate)
+        , serializer_(nullptr)
+    {
+    }
+
+    void set_serializer(v8::ValueSerializer* serializer)
+    {
+        serializer_ = serializer;
+    }
+
+    void ThrowDataCloneError(v8::Local<v8::String> message) override
+    {
+        isolate_->ThrowException(v8::Exception::Error(message));
+    }
+
+    v8::Maybe<bool> WriteHostObject(v8::Isolate* isolate, v8::Local<v8::Object> object) override
+    {
+        if (!object->IsArrayBufferView())
+        {
+            return v8::ValueSerializer::Delegate::WriteHostObject(isolate, object);
+        }
+
+        v8::Local<v8::ArrayBufferView> view = object.As<v8::ArrayBufferView>();
+        v8::Local<v8::ArrayBuffer> buffer = view->Buffer();
+
+        uint32_t index;
+        if (!find_buffer(buffer, &index))
+        {
+            // E.g. a SharedArrayBuffer or a buffer of WebAssembly memory
+            if (!buffer->IsDetachable())
+            {
+                ThrowDataCloneError(v8::String::NewFromUtf8Literal(
+                    isolate, "Array buffer can't be moved"));
+                return v8::Nothing<bool>();
+            }
+
+            index = static_cast<uint32_t>(buffers_.size());
+
+            buffers_.push_back(buffer);
+            stores_.push_back(buffer->GetBackingStore());
+            indexes_.emplace(buffer->GetIdentityHash(), index);
+        }
+
+        const uint32_t tag = get_array_buffer_view_tag(view);
+
+        serializer_->WriteUint32(index);
+        serializer_->WriteUint32(tag);
+        serializer_->WriteUint64(view->ByteOffset());
+        serializer_->WriteUint64(tag == data_view_tag
+            ? view->ByteLength()
+            : view.As<v8::TypedArray>()->Length());
+
+        return v8::Just(true);
+    }
+
+    // Detaches moved buffers from the source VM
+    void detach_buffers()
+    {
+        for (auto& buffer : buffers_)
+        {
+            buffer->Detach();
+        }
+    }
+
+    backing_stores release_stores()
+    {
+        return std::move(stores_);
+    }
+
+private:
+    bool find_buffer(v8::Local<v8::ArrayBuffer> buffer, uint32_t* index) const
+    {
+        const auto range = indexes_.equal_range(buffer->GetIdentityHash());
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (buffers_[it->second] == buffer)
+            {
+                *index = it->second;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    v8::Isolate* isolate_;
+    v8::ValueSerializer* serializer_;
+    std::vector<v8::Local<v8::ArrayBuffer>> buffers_;
+    backing_stores stores_;
+
+    // Identity hash of a buffer -> its index in buffers_
+    std::unordered_multimap<int, uint32_t> indexes_;
+};
+
+class deserializer_delegate
+    : public v8::ValueDeserializer::Delegate
+{
+public:
+    explicit deserializer_delegate(backing_stores* stores)
+        : stores_(stores)
+        , deserializer_(nullptr)
+    {
+        if (stores_)
+        {
+            buffers_.resize(stores_->size());
+        }
+    }
+
+    void set_deserializer(v8::ValueDeserializer* deserializer)
+    {
+        deserializer_ = deserializer;
+    }
+
+    v8::MaybeLocal<v8::Object> ReadHostObject(v8::Isolate* isolate) override
+    {
+        uint32_t index;
+        uint32_t tag;
+        uint64_t offset;
+        uint64_t length;
+
+        if (!deserializer_->ReadUint32(&index)
+            || !deserializer_->ReadUint32(&tag)
+            || !deserializer_->ReadUint64(&offset)
+            || !deserializer_->ReadUint64(&length)
+            || index >= buffers_.size()
+            || ((*stores_)[index] == nullptr && buffers_[index].IsEmpty()))
+        {
+            isolate->ThrowException(v8::Exception::Error(
+                v8::String::NewFromUtf8(isolate, "Unable to deserialize array buffer view",
+                    v8::NewStringType::kNormal).ToLocalChecked()));
+            return v8::MaybeLocal<v8::Object>();
+        }
+
+        if (buffers_[index].IsEmpty())
+        {
+            buffers_[index] = v8::ArrayBuffer::New(isolate, std::move((*stores_)[index]));
+        }
+
+        v8::Local<v8::ArrayBuffer> buffer = buffers_[index];
+
+        const auto byte_offset = static_cast<size_t>(offset);
+        const auto size = static_cast<size_t>(length);
+
+        switch (tag)
+        {
+        case v8_int8_array:
+            return v8::Int8Array::New(buffer, byte_offset, size);
+        case v8_uint8_array:
+            return v8::Uint8Array::New(buffer, byte_offset, size);
+        case v8_uint8_clamped_array:
+            return v8::Uint8ClampedArray::New(buffer, byte_offset, size);
+        case v8_int16_array:
+            return v8::Int16Array::New(buffer, byte_offset, size);
+        case v8_uint16_array:
+            return v8::Uint16Array::New(buffer, byte_offset, size);
+        case v8_int32_array:
+            return v8::Int32Array::New(buffer, byte_offset, size);
+        case v8_uint32_array:
+            return v8::Uint32Array::New(buffer, byte_offset, size);
+        case v8_float32_array:
+            return v8::Float32Array::New(buffer, byte_offset, size);
+        case v8_float64_array:
+            return v8::Float64Array::New(buffer, byte_offset, size);
+        case v8_big_int64_array:
+            return v8::BigInt64Array::New(buffer, byte_offset, size);
+        case v8_big_uint64_array:
+            return v8::BigUint64Array::New(buffer, byte_offset, size);
+        default:
+            return v8::DataView::New(buffer, byte_offset, size);
+        }
+    }
+
+private:
+    backing_stores* stores_;
+    v8::ValueDeserializer* deserializer_;
+    std::vector<v8::Local<v8::ArrayBuffer>> buffers_;
+};
+
+bool v8_serialize_value(
+    v8_script* script,
+    v8_value value,
+    int flags,
+    v8_serialized_value* result,
+    v8_error* error)
+{
+    assert(result);
+
+    if (!result)
+    {
+        return false;
+    }
+
+    return in_script_context(script, error,
+        [value, flags, result](v8::Local<v8::Context> context)
+        {
+            v8::Isolate* isolate = context->GetIsolate();
+
+            serializer_delegate delegate(isolate);
+
+            v8::ValueSerializer serializer(isolate, &delegate);
+
+            delegate.set_serializer(&serializer);
+
+            // Otherwise buffers are copied by the serializer
+            const bool move_buffers = (flags & v8_move_buffers) != 0;
+
+            serializer.SetTreatArrayBufferViewsAsHostObjects(move_buffers);
+            serializer.WriteHeader();
+
+            if (!serializer.WriteValue(context, to_v8_value(context, value)).FromMaybe(false))
+            {
+                return false;
+            }
+
+            if (move_buffers)
+            {
+                delegate.detach_buffers();
+            }
+
+            const auto data = serializer.Release();
+
+            result->data = data.first;
+            result->size = data.second;
+            result->transferred = new backing_stores(delegate.release_stores());
+
+            return true;
+        });
+}
+
+bool v8_deserialize_value(
+    v8_script* script,
+    v8_serialized_value* data,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(data);
+    assert(result);
+
+    if (!data || !result)
+    {
+        return false;
+    }
+
+    return in_script_context(script, error,
+        [data, result](v8::Local<v8::Context> context)
+        {
+            v8::Isolate* isolate = context->GetIsolate();
+
+            deserializer_delegate delegate(
+                static_cast<backing_stores*>(data->transferred));
+
+            v8::ValueDeserializer deserializer(isolate, data->data, data->size, &delegate);
+
+            delegate.set_deserializer(&deserializer);
+
+            if (!deserializer.ReadHeader(context).FromMaybe(false))
+            {
+                return false;
+            }
+
+            v8::Local<v8::Value> value;
+            if (!deserializer.ReadValue(context).ToLocal(&value))
+            {
+                return false;
+            }
+
+            *result = from_v8_value(context, value);
+            return true;
+        });
+}
+
+void v8_delete_serialized_value(
+    v8_serialized_value* value)
+{
+    assert(value);
+
+    if (!value)
+    {
+        return;
+    }
+
+    // The buffer is allocated by the default
+    // ValueSerializer::Delegate with realloc
+    std::free(value->data);
+
+    delete static_cast<backing_stores*>(value->transferred);
+
+    value->data = nullptr;
+    value->size = 0;
+    value->transferred = nullptr;
+}
+
+// Enters the VM and the context of the handle and calls
+// func(context, object) which returns the JS value to
+// convert into result
+template <class Func>
+bool access_handle(
+    v8_value handle,
+    bool materialize,
+    v8_value* result,
+    v8_error* error,
+    Func func)
+{
+    js_handle* impl = to_js_handle(handle);
+
+    assert(impl);
+    assert(result);
+    assert(error);
+
+    if (!impl || !result || !error)
+    {
+        return false;
+    }
+
+    clean_error(*error);
+
+    v8::Isolate* isolate = impl->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, impl->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::TryCatch try_catch(isolate);
+
+    v8::Local<v8::Object> object =
+        v8::Local<v8::Value>::New(isolate, impl->value_).As<v8::Object>();
+
+    v8::Local<v8::Value> res;
+    if (!func(context, object).ToLocal(&res))
+    {
+        make_error(isolate, try_catch, error);
+        return false;
+    }
+
+    int flags = get_conversion_flags(isolate);
+    if (materialize)
+    {
+        flags &= ~v8_convert_to_handles;
+    }
+
+    *result = from_v8_value(context, res, flags);
+    return true;
+}
+
+bool v8_get_property(
+    v8_value handle,
+    const char* name,
+    v8_value* result,
+    v8_error* error)
+{
+    assert(name);
+
+    if (!name)
+    {
+        return false;
+    }
+
+    return access_handle(handle, false, result, error,
+        [name](v8::Local<v8::Context> context, v8::Local<v8::Object> object)
+        {
+            v8::Local<v8::String> key;
+            if (!v8::String::NewFromUtf8(
+                context->GetIsolate(), name, v8::NewStringType::kNormal).ToLocal(&key))
+            {
+                return v8::MaybeLocal<v8::Value>();
+            }
+
+            return object->Get(context, key);
+        });
+}
+
+bool v8_get_element(
+    v8_value handle,
+    uint32_t index,
+    v8_value* result,
+    v8_error* error)
+{
+    return access_handle(handle, false, result, error,
+        [index](v8::Local<v8::Context> context, v8::Local<v8::Object> object)
+        {
+            return object->Get(context, index);
+        });
+}
+
+bool v8_get_keys(
+    v8_value handle,
+    v8_value* result,
+    v8_error* error)
+{
+    return access_handle(handle, true, result, error,
+        [](v8::Local<v8::Context> context, v8::Local<v8::Object> object)
+        {
+            v8::Local<v8::Array> names;
+            if (!object->GetOwnPropertyNames(context).ToLocal(&names))
+            {
+                return v8::MaybeLocal<v8::Value>();
+            }
+
+            return v8::MaybeLocal<v8::Value>(names);
+        });
+}
+
+bool v8_materialize(
+    v8_value handle,
+    v8_value* result,
+    v8_error* error)
+{
+    return access_handle(handle, true, result, error,
+        [](v8::Local<v8::Context> /*context*/, v8::Local<v8::Object> object)
+        {
+            return v8::MaybeLocal<v8::Value>(object);
+        });
+}
+
+int64_t v8_get_length(
+    v8_value handle)
+{
+    js_handle* impl = to_js_handle(handle);
+
+    assert(impl);
+
+    if (!impl)
+    {
+        return -1;
+    }
+
+    v8::Isolate* isolate = impl->isolate_;
+
+    vm_scope vm(isolate);
+
+    v8::HandleScope handle_scope(isolate);
+
+    v8::Local<v8::Context> context =
+        v8::Local<v8::Context>::New(isolate, impl->context_);
+
+    v8::Context::Scope context_scope(context);
+
+    v8::Local<v8::Value> value =
+        v8::Local<v8::Value>::New(isolate, impl->value_);
+
+    if (value->IsArray())
+    {
+        return value.As<v8::Array>()->Length();
+    }
+
+    if (value->IsTypedArray())
+    {
+        return static_cast<int64_t>(value.As<v8::TypedArray>()->Length());
+    }
+
+    if (value->IsSet())
+    {
+        return static_cast<int64_t>(value.As<v8::Set>()->Size());
+    }
+
+    if (value->IsMap())
+    {
+        return static_cast<int64_t>(value.As<v8::Map>()->Size());
+    }
+
+    v8::Local<v8::Array> names;
+    if (!value.As<v8::Object>()->GetOwnPropertyNames(context).ToLocal(&names))
+    {
+        return -1;
+    }
+
+    return names->Length();
 }
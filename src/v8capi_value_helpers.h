@@ -1,8 +1,55 @@
 ﻿#pragma once
 
+#include <memory>
+#include <optional>
+
 #include <v8.h>
 
 #include "../include/v8capi_values.h"
 
+int get_conversion_flags(v8::Isolate* isolate);
+
+// Enters and locks the VM for one call. Nothing is done if
+// the current thread already did it, e.g. within a session
+// started with v8_enter
+class vm_scope
+{
+public:
+    explicit vm_scope(v8::Isolate* isolate);
+
+    vm_scope(const vm_scope&) = delete;
+    vm_scope& operator=(const vm_scope&) = delete;
+
+private:
+    std::optional<v8::Isolate::Scope> isolate_scope_;
+    std::optional<v8::Locker> locker_;
+};
+
+struct v8_object_shape
+{
+    v8::Isolate* isolate_;
+    int32_t size_;
+    std::unique_ptr<v8::Persistent<v8::String>[]> keys_;
+};
+
+// JS value referenced by a v8_handle value
+struct js_handle
+{
+    v8::Isolate* isolate_;
+    v8::Persistent<v8::Context> context_;
+    v8::Persistent<v8::Value> value_;
+};
+
+// Returns NULL if the value is not a handle
+js_handle* to_js_handle(v8_value val);
+
 v8_value from_v8_value(v8::Local<v8::Context> context, v8::Local<v8::Value> val);
+v8_value from_v8_value(v8::Local<v8::Context> context, v8::Local<v8::Value> val, int flags);
 v8::Local<v8::Value> to_v8_value(v8::Local<v8::Context> context, v8_value val);
+// Converts count values to result in the current handle scope,
+// references are resolved across all of them
+void to_v8_values(
+    v8::Local<v8::Context> context,
+    int count,
+    const v8_value* values,
+    v8::Local<v8::Value>* result);
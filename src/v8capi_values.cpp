@@ -1,12 +1,21 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
 #include <cstring>
 #include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include <v8.h>
 
 #include "v8capi_value_helpers.h"
 
+#include "../include/v8capi.h"
 #include "../include/v8capi_values.h"
 
 enum class js_types : int16_t
@@ -23,9 +32,56 @@ enum class js_types : int16_t
     set         = v8_set,
     map         = v8_map,
     function    = v8_function,
-    date        = v8_date
+    date        = v8_date,
+
+    array_buffer        = v8_array_buffer,
+    int8_array          = v8_int8_array,
+    uint8_array         = v8_uint8_array,
+    uint8_clamped_array = v8_uint8_clamped_array,
+    int16_array         = v8_int16_array,
+    uint16_array        = v8_uint16_array,
+    int32_array         = v8_int32_array,
+    uint32_array        = v8_uint32_array,
+    float32_array       = v8_float32_array,
+    float64_array       = v8_float64_array,
+    big_int64_array     = v8_big_int64_array,
+    big_uint64_array    = v8_big_uint64_array,
+
+    number_array        = v8_number_array,
+    handle              = v8_handle,
+    reference           = v8_reference
 };
 
+bool is_typed_array(js_types type)
+{
+    return type >= js_types::int8_array
+        && type <= js_types::big_uint64_array;
+}
+
+size_t get_element_size(js_types type)
+{
+    switch (type)
+    {
+    case js_types::int8_array:          // fallthrough
+    case js_types::uint8_array:         // fallthrough
+    case js_types::uint8_clamped_array:
+        return 1;
+    case js_types::int16_array:         // fallthrough
+    case js_types::uint16_array:
+        return 2;
+    case js_types::int32_array:         // fallthrough
+    case js_types::uint32_array:        // fallthrough
+    case js_types::float32_array:
+        return 4;
+    case js_types::float64_array:       // fallthrough
+    case js_types::big_int64_array:     // fallthrough
+    case js_types::big_uint64_array:
+        return 8;
+    default:
+        return 1;
+    }
+}
+
 enum class type_specifiers : int16_t
 {
     not_special     = 0,
@@ -35,6 +91,19 @@ enum class type_specifiers : int16_t
     int64,          // int64_t
     int32,          // int32_t
     uint32,         // uint32_t
+
+    // js big int (also int64)
+    uint64,         // uint64_t
+
+    // js object
+    shaped,             // v8_object_shape* followed by the values
+
+    // js string
+    external_one_byte,  // external_buffer with Latin-1 text
+    external_two_byte,  // external_buffer with UTF-16 text
+    shared,             // shared_string
+
+    // reference keeps js_types of the referenced value
 };
 
 struct v8_value_impl
@@ -53,6 +122,9 @@ static_assert(offsetof(v8_value_impl, type) == 8);
 static_assert(offsetof(v8_value_impl, specifier) == 10);
 static_assert(offsetof(v8_value_impl, size) == 12);
 
+static_assert(sizeof(v8_pair_value) == 2 * sizeof(v8_value));
+static_assert(offsetof(v8_pair_value, second) == sizeof(v8_value));
+
 v8_value to_value(v8_value_impl val_impl)
 {
     v8_value val;
@@ -67,6 +139,110 @@ v8_value_impl to_value_impl(v8_value val)
     return val_impl;
 }
 
+// Caller-owned memory shared between a value and
+// JS heap objects created from it, the release callback
+// is called when the last reference is dropped
+struct external_buffer
+{
+    void* data;
+    size_t size;
+    v8_release_callback release;
+    void* userdata;
+    std::atomic<int32_t> references;
+};
+
+external_buffer* new_external_buffer(
+    void* data,
+    size_t size,
+    v8_release_callback release,
+    void* userdata)
+{
+    auto buffer = new external_buffer;
+    buffer->data = data;
+    buffer->size = size;
+    buffer->release = release;
+    buffer->userdata = userdata;
+    buffer->references = 1;
+    return buffer;
+}
+
+void acquire_external_buffer(external_buffer* buffer)
+{
+    buffer->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+void release_external_buffer(external_buffer* buffer)
+{
+    if (buffer->references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+
+    if (buffer->release)
+    {
+        buffer->release(buffer->data, buffer->userdata);
+    }
+
+    delete buffer;
+}
+
+// Immutable string referenced by many values, object keys
+// converted from JS share one such string per conversion
+struct shared_string
+{
+    std::atomic<int32_t> references;
+    std::string data;
+};
+
+void acquire_shared_string(shared_string* str)
+{
+    str->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+void release_shared_string(shared_string* str)
+{
+    if (str->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        delete str;
+    }
+}
+
+template <class Resource, class Char>
+class external_string_resource final
+    : public Resource
+{
+public:
+    explicit external_string_resource(external_buffer* buffer)
+        : buffer_(buffer)
+    {
+        acquire_external_buffer(buffer_);
+    }
+
+    ~external_string_resource() override
+    {
+        release_external_buffer(buffer_);
+    }
+
+    const Char* data() const override
+    {
+        return static_cast<const Char*>(buffer_->data);
+    }
+
+    size_t length() const override
+    {
+        return buffer_->size;
+    }
+
+private:
+    external_buffer* buffer_;
+};
+
+using external_one_byte_resource = external_string_resource<
+    v8::String::ExternalOneByteStringResource, char>;
+
+using external_two_byte_resource = external_string_resource<
+    v8::String::ExternalStringResource, uint16_t>;
+
 v8_value v8_new_undefined()
 {
     v8_value_impl val_impl = 
@@ -134,6 +310,30 @@ v8_value v8_new_integer(int64_t value)
     return to_value(val_impl);
 }
 
+v8_value v8_new_big_int(int64_t value)
+{
+    v8_value_impl val_impl =
+    {
+        reinterpret_cast<void*>(value),
+        js_types::big_int,
+        type_specifiers::int64,
+        0
+    };
+    return to_value(val_impl);
+}
+
+v8_value v8_new_big_uint(uint64_t value)
+{
+    v8_value_impl val_impl =
+    {
+        reinterpret_cast<void*>(value),
+        js_types::big_int,
+        type_specifiers::uint64,
+        0
+    };
+    return to_value(val_impl);
+}
+
 v8_value v8_new_string(const char* value, int32_t length)
 {
     assert(value);
@@ -167,6 +367,151 @@ v8_value v8_new_string(const char* value, int32_t length)
     return to_value(val_impl);
 }
 
+v8_value make_external_string(
+    const void* value,
+    int32_t length,
+    type_specifiers specifier,
+    v8_release_callback release,
+    void* userdata)
+{
+    assert(value);
+    assert(length >= 0);
+
+    if (!value || length < 0)
+    {
+        return v8_new_undefined();
+    }
+
+    v8_value_impl val_impl =
+    {
+        new_external_buffer(
+            const_cast<void*>(value),
+            static_cast<size_t>(length),
+            release,
+            userdata),
+        js_types::string,
+        specifier,
+        length
+    };
+
+    return to_value(val_impl);
+}
+
+v8_value v8_new_external_string(
+    const char* value,
+    int32_t length,
+    v8_release_callback release,
+    void* userdata)
+{
+    return make_external_string(
+        value, length, type_specifiers::external_one_byte, release, userdata);
+}
+
+v8_value v8_new_external_string16(
+    const uint16_t* value,
+    int32_t length,
+    v8_release_callback release,
+    void* userdata)
+{
+    return make_external_string(
+        value, length, type_specifiers::external_two_byte, release, userdata);
+}
+
+v8_value make_buffer(
+    js_types type,
+    void* data,
+    int32_t size,
+    v8_release_callback release,
+    void* userdata)
+{
+    assert(data || size == 0);
+    assert(size >= 0);
+
+    if ((!data && size != 0) || size < 0)
+    {
+        return v8_new_undefined();
+    }
+
+    v8_value_impl val_impl =
+    {
+        new_external_buffer(
+            data,
+            static_cast<size_t>(size) * get_element_size(type),
+            release,
+            userdata),
+        type,
+        type_specifiers::not_special,
+        size
+    };
+
+    return to_value(val_impl);
+}
+
+v8_value v8_new_array_buffer(
+    void* data,
+    int32_t size,
+    v8_release_callback release,
+    void* userdata)
+{
+    return make_buffer(js_types::array_buffer, data, size, release, userdata);
+}
+
+v8_value v8_new_typed_array(
+    int type,
+    void* data,
+    int32_t size,
+    v8_release_callback release,
+    void* userdata)
+{
+    assert(is_typed_array(static_cast<js_types>(type)));
+
+    if (!is_typed_array(static_cast<js_types>(type)))
+    {
+        return v8_new_undefined();
+    }
+
+    return make_buffer(static_cast<js_types>(type), data, size, release, userdata);
+}
+
+template <class T>
+v8_value make_number_array(const T* data, int32_t size, type_specifiers specifier)
+{
+    assert(data || size == 0);
+    assert(size >= 0);
+
+    if ((!data && size != 0) || size < 0)
+    {
+        return v8_new_undefined();
+    }
+
+    v8_value_impl val_impl =
+    {
+        size == 0
+            ? nullptr
+            : new T[size],
+        js_types::number_array,
+        specifier,
+        size
+    };
+
+    if (size > 0)
+    {
+        std::memcpy(val_impl.data, data, sizeof(T) * static_cast<size_t>(size));
+    }
+
+    return to_value(val_impl);
+}
+
+v8_value v8_new_number_array(const double* data, int32_t size)
+{
+    return make_number_array(data, size, type_specifiers::number);
+}
+
+v8_value v8_new_integer_array(const int32_t* data, int32_t size)
+{
+    return make_number_array(data, size, type_specifiers::int32);
+}
+
 template <class T>
 v8_value make_sequense(int32_t size, js_types type)
 {
@@ -195,6 +540,38 @@ v8_value v8_new_object(int32_t size)
     return make_sequense<v8_pair_value>(size, js_types::object);
 }
 
+// The first element of the block keeps the shape,
+// the values follow it
+v8_value v8_new_shaped_object(v8_object_shape* shape)
+{
+    assert(shape);
+
+    if (!shape)
+    {
+        return v8_new_undefined();
+    }
+
+    auto block = new v8_value[shape->size_ + 1];
+
+    block[0].data = shape;
+    block[0].specifiers = 0;
+
+    for (int32_t i = 1; i <= shape->size_; ++i)
+    {
+        block[i] = v8_new_undefined();
+    }
+
+    v8_value_impl val_impl =
+    {
+        block,
+        js_types::object,
+        type_specifiers::shaped,
+        shape->size_
+    };
+
+    return to_value(val_impl);
+}
+
 v8_value v8_new_array(int32_t size)
 {
     return make_sequense<v8_value>(size, js_types::array);
@@ -237,7 +614,8 @@ bool v8_is_number(v8_value value)
 bool v8_is_double(v8_value value)
 {
     const auto val_impl = to_value_impl(value);
-    return val_impl.specifier == type_specifiers::number;
+    return val_impl.type == js_types::number
+        && val_impl.specifier == type_specifiers::number;
 }
 
 bool v8_is_integer(v8_value value)
@@ -253,12 +631,25 @@ bool v8_is_string(v8_value value)
     return val_impl.type == js_types::string;
 }
 
+bool v8_is_big_int(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return val_impl.type == js_types::big_int;
+}
+
 bool v8_is_object(v8_value value)
 {
     const auto val_impl = to_value_impl(value);
     return val_impl.type == js_types::object;
 }
 
+bool v8_is_shaped_object(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return val_impl.type == js_types::object
+        && val_impl.specifier == type_specifiers::shaped;
+}
+
 bool v8_is_array(v8_value value)
 {
     const auto val_impl = to_value_impl(value);
@@ -277,6 +668,85 @@ bool v8_is_map(v8_value value)
     return val_impl.type == js_types::map;
 }
 
+bool v8_is_array_buffer(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return val_impl.type == js_types::array_buffer;
+}
+
+bool v8_is_typed_array(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return is_typed_array(val_impl.type);
+}
+
+bool v8_is_number_array(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return val_impl.type == js_types::number_array;
+}
+
+bool v8_is_handle(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return val_impl.type == js_types::handle;
+}
+
+bool v8_is_reference(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return val_impl.type == js_types::reference;
+}
+
+v8_value new_reference(v8_value_impl val_impl)
+{
+    val_impl.specifier = static_cast<type_specifiers>(val_impl.type);
+    val_impl.type = js_types::reference;
+    return to_value(val_impl);
+}
+
+v8_value v8_new_reference(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    const bool ok = val_impl.type == js_types::array
+        || val_impl.type == js_types::set
+        || val_impl.type == js_types::map
+        || (val_impl.type == js_types::object
+            && val_impl.specifier != type_specifiers::shaped);
+
+    assert(ok);
+
+    if (!ok)
+    {
+        return v8_new_undefined();
+    }
+
+    return new_reference(val_impl);
+}
+
+v8_value v8_resolve_reference(v8_value value)
+{
+    auto val_impl = to_value_impl(value);
+
+    if (val_impl.type != js_types::reference)
+    {
+        return value;
+    }
+
+    val_impl.type = static_cast<js_types>(val_impl.specifier);
+    val_impl.specifier = type_specifiers::not_special;
+    return to_value(val_impl);
+}
+
+js_handle* to_js_handle(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+    return val_impl.type == js_types::handle
+        ? static_cast<js_handle*>(val_impl.data)
+        : nullptr;
+}
+
 int v8_get_value_type(v8_value value)
 {
     const auto val_impl = to_value_impl(value);
@@ -328,13 +798,27 @@ int64_t v8_to_int64(v8_value value)
 {
     const auto val_impl = to_value_impl(value);
 
-    assert(val_impl.type == js_types::number);
+    assert(val_impl.type == js_types::number
+        || val_impl.type == js_types::big_int);
 
-    if (val_impl.type != js_types::number)
+    if (val_impl.type != js_types::number
+        && val_impl.type != js_types::big_int)
     {
         return 0;
     }
 
+    if (val_impl.specifier == type_specifiers::uint64)
+    {
+        // Use v8_to_uint64 for values above INT64_MAX
+        const auto unsigned_value = reinterpret_cast<uint64_t>(val_impl.data);
+
+        constexpr auto max = static_cast<uint64_t>(std::numeric_limits<int64_t>::max());
+
+        assert(unsigned_value <= max);
+
+        return static_cast<int64_t>(std::min(unsigned_value, max));
+    }
+
     if (val_impl.specifier != type_specifiers::number)
     {
         return reinterpret_cast<int64_t>(value.data);
@@ -343,6 +827,19 @@ int64_t v8_to_int64(v8_value value)
     return static_cast<int64_t>(get_double(val_impl.data));
 }
 
+uint64_t v8_to_uint64(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    if (val_impl.type == js_types::big_int
+        && val_impl.specifier == type_specifiers::uint64)
+    {
+        return reinterpret_cast<uint64_t>(val_impl.data);
+    }
+
+    return static_cast<uint64_t>(v8_to_int64(value));
+}
+
 v8_string_value v8_to_string(v8_value* value)
 {
     assert(value);
@@ -369,14 +866,39 @@ v8_string_value v8_to_string(v8_value* value)
         };
     }
 
-    return
+    switch (val_impl.specifier)
     {
-        val_impl.size,
-        static_cast<size_t>(val_impl.size) < sizeof(void*)
-            ? reinterpret_cast<const char*>(&value->data)
-            : static_cast<const char*>(value->data)
-    };
-}
+    case type_specifiers::external_one_byte:
+        return
+        {
+            val_impl.size,
+            static_cast<const char*>(
+                static_cast<external_buffer*>(val_impl.data)->data)
+        };
+    case type_specifiers::external_two_byte:
+        return
+        {
+            0,
+            nullptr
+        };
+    case type_specifiers::shared:
+        return
+        {
+            val_impl.size,
+            static_cast<shared_string*>(val_impl.data)->data.c_str()
+        };
+    default:
+        break;
+    }
+
+    return
+    {
+        val_impl.size,
+        static_cast<size_t>(val_impl.size) < sizeof(void*)
+            ? reinterpret_cast<const char*>(&value->data)
+            : static_cast<const char*>(value->data)
+    };
+}
 
 template <class T>
 T to_sequense(v8_value value, js_types type)
@@ -403,9 +925,46 @@ T to_sequense(v8_value value, js_types type)
 
 v8_object_value v8_to_object(v8_value value)
 {
+    assert(!v8_is_shaped_object(value));
+
+    if (v8_is_shaped_object(value))
+    {
+        return
+        {
+            0,
+            nullptr
+        };
+    }
+
     return to_sequense<v8_object_value>(value, js_types::object);
 }
 
+v8_shaped_object_value v8_to_shaped_object(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    assert(v8_is_shaped_object(value));
+
+    if (!v8_is_shaped_object(value))
+    {
+        return
+        {
+            0,
+            nullptr,
+            nullptr
+        };
+    }
+
+    auto block = static_cast<v8_value*>(val_impl.data);
+
+    return
+    {
+        val_impl.size,
+        block + 1,
+        static_cast<v8_object_shape*>(block[0].data)
+    };
+}
+
 v8_array_value v8_to_array(v8_value value)
 {
     return to_sequense<v8_array_value>(value, js_types::array);
@@ -421,20 +980,113 @@ v8_map_value v8_to_map(v8_value value)
     return to_sequense<v8_map_value>(value, js_types::map);
 }
 
+v8_buffer_value to_buffer(v8_value_impl val_impl)
+{
+    return
+    {
+        val_impl.size,
+        static_cast<external_buffer*>(val_impl.data)->data
+    };
+}
+
+v8_buffer_value v8_to_array_buffer(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    assert(val_impl.type == js_types::array_buffer);
+
+    if (val_impl.type != js_types::array_buffer)
+    {
+        return
+        {
+            0,
+            nullptr
+        };
+    }
+
+    return to_buffer(val_impl);
+}
+
+v8_buffer_value v8_to_typed_array(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    assert(is_typed_array(val_impl.type));
+
+    if (!is_typed_array(val_impl.type))
+    {
+        return
+        {
+            0,
+            nullptr
+        };
+    }
+
+    return to_buffer(val_impl);
+}
+
+v8_number_array_value v8_to_number_array(v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    assert(val_impl.type == js_types::number_array);
+
+    if (val_impl.type != js_types::number_array)
+    {
+        return
+        {
+            0,
+            nullptr,
+            nullptr
+        };
+    }
+
+    if (val_impl.specifier == type_specifiers::int32)
+    {
+        return
+        {
+            val_impl.size,
+            nullptr,
+            static_cast<int32_t*>(val_impl.data)
+        };
+    }
+
+    return
+    {
+        val_impl.size,
+        static_cast<double*>(val_impl.data),
+        nullptr
+    };
+}
+
 void set_undefined(v8_value* value)
 {
     std::memset(value, 0, sizeof(v8_value));
 }
 
-void v8_delete_value(v8_value* value)
-{
-    assert(value);
+void delete_value(v8_value* value, std::vector<v8_value>& pending);
 
-    if (!value)
+// Elements which are containers are moved to the pending
+// stack instead of being deleted recursively
+void delete_element(v8_value* value, std::vector<v8_value>& pending)
+{
+    switch (to_value_impl(*value).type)
     {
+    case js_types::object:  // fallthrough
+    case js_types::array:   // fallthrough
+    case js_types::set:     // fallthrough
+    case js_types::map:
+        pending.push_back(*value);
+        set_undefined(value);
+        return;
+    default:
+        delete_value(value, pending);
         return;
     }
+}
 
+void delete_value(v8_value* value, std::vector<v8_value>& pending)
+{
     const auto val_impl = to_value_impl(*value);
 
     switch (val_impl.type)
@@ -443,28 +1095,46 @@ void v8_delete_value(v8_value* value)
         return;
     case js_types::boolean: // fallthrough
     case js_types::null:    // fallthrough
-    case js_types::number:
+    case js_types::number:  // fallthrough
+    case js_types::big_int:
         set_undefined(value);
         return;
     case js_types::string:
-        if (static_cast<size_t>(val_impl.size) >= sizeof(void*))
+        if (val_impl.specifier == type_specifiers::external_one_byte
+            || val_impl.specifier == type_specifiers::external_two_byte)
+        {
+            release_external_buffer(static_cast<external_buffer*>(val_impl.data));
+        }
+        else if (val_impl.specifier == type_specifiers::shared)
+        {
+            release_shared_string(static_cast<shared_string*>(val_impl.data));
+        }
+        else if (static_cast<size_t>(val_impl.size) >= sizeof(void*))
         {
             delete[] static_cast<char*>(val_impl.data);
         }
         set_undefined(value);
         return;
-    case js_types::big_int:
-        assert(!"not implemented");
-        return;
     case js_types::symbol:
         assert(!"not implemented");
         return;
     case js_types::object:
+        if (val_impl.specifier == type_specifiers::shaped)
+        {
+            auto block = static_cast<v8_value*>(val_impl.data);
+            for (int i = 1; i <= val_impl.size; ++i)
+            {
+                delete_element(&block[i], pending);
+            }
+            delete[] block;
+            set_undefined(value);
+            return;
+        }
         for (int i = 0; i < val_impl.size; ++i)
         {
-            auto pair = static_cast<v8_pair_value*>(val_impl.data)[i];
-            v8_delete_value(&pair.first);
-            v8_delete_value(&pair.second);
+            auto pair = &static_cast<v8_pair_value*>(val_impl.data)[i];
+            delete_element(&pair->first, pending);
+            delete_element(&pair->second, pending);
         }
         delete[] static_cast<v8_pair_value*>(val_impl.data);
         set_undefined(value);
@@ -473,7 +1143,7 @@ void v8_delete_value(v8_value* value)
     case js_types::set:
         for (int i = 0; i < val_impl.size; ++i)
         {
-            v8_delete_value(&static_cast<v8_value*>(val_impl.data)[i]);
+            delete_element(&static_cast<v8_value*>(val_impl.data)[i], pending);
         }
         delete[] static_cast<v8_value*>(val_impl.data);
         set_undefined(value);
@@ -482,8 +1152,8 @@ void v8_delete_value(v8_value* value)
         for (int i = 0; i < val_impl.size; ++i)
         {
             auto pair = &static_cast<v8_pair_value*>(val_impl.data)[i];
-            v8_delete_value(&pair->first);
-            v8_delete_value(&pair->second);
+            delete_element(&pair->first, pending);
+            delete_element(&pair->second, pending);
         }
         delete[] static_cast<v8_pair_value*>(val_impl.data);
         set_undefined(value);
@@ -494,308 +1164,1308 @@ void v8_delete_value(v8_value* value)
     case js_types::date:
         assert(!"not implemented");
         return;
+    case js_types::array_buffer:        // fallthrough
+    case js_types::int8_array:          // fallthrough
+    case js_types::uint8_array:         // fallthrough
+    case js_types::uint8_clamped_array: // fallthrough
+    case js_types::int16_array:         // fallthrough
+    case js_types::uint16_array:        // fallthrough
+    case js_types::int32_array:         // fallthrough
+    case js_types::uint32_array:        // fallthrough
+    case js_types::float32_array:       // fallthrough
+    case js_types::float64_array:       // fallthrough
+    case js_types::big_int64_array:     // fallthrough
+    case js_types::big_uint64_array:
+        release_external_buffer(static_cast<external_buffer*>(val_impl.data));
+        set_undefined(value);
+        return;
+    case js_types::number_array:
+        if (val_impl.specifier == type_specifiers::int32)
+        {
+            delete[] static_cast<int32_t*>(val_impl.data);
+        }
+        else
+        {
+            delete[] static_cast<double*>(val_impl.data);
+        }
+        set_undefined(value);
+        return;
+    case js_types::reference:
+        set_undefined(value);
+        return;
+    case js_types::handle:
+    {
+        auto handle = static_cast<js_handle*>(val_impl.data);
+        {
+            vm_scope vm(handle->isolate_);
+            handle->value_.Reset();
+            handle->context_.Reset();
+        }
+        delete handle;
+        set_undefined(value);
+        return;
+    }
     }
 }
 
-v8_value from_v8_value(v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+void v8_delete_value(v8_value* value)
 {
-    if (value->IsNullOrUndefined())
+    assert(value);
+
+    if (!value)
     {
-        return value->IsUndefined()
-            ? v8_new_undefined()
-            : v8_new_null();
+        return;
     }
 
-    if (value->IsNumber())
+    // Explicit stack of containers to delete, so deep
+    // values do not overflow the native stack
+    std::vector<v8_value> pending;
+
+    delete_value(value, pending);
+
+    while (!pending.empty())
     {
-        if (value->IsUint32() || value->IsInt32())
-        {
-            v8::Integer* integer = v8::Integer::Cast(*value);
-            return v8_new_integer(integer->Value());
-        }
+        v8_value next = pending.back();
+        pending.pop_back();
+        delete_value(&next, pending);
+    }
+}
 
-        double number;
-        if (value->NumberValue(context).To(&number))
-        {
-            return v8_new_number(number);
-        }
+void delete_backing_store(void* /*data*/, void* userdata)
+{
+    delete static_cast<std::shared_ptr<v8::BackingStore>*>(userdata);
+}
 
-        assert(!"invalid conversion");
+// The value holds a reference to the backing store,
+// so JS memory is exposed to C without copying. Buffers
+// which size does not fit into int32_t are converted
+// to undefined
+v8_value from_v8_buffer(
+    js_types type,
+    v8::Local<v8::ArrayBuffer> buffer,
+    size_t byte_offset,
+    size_t length)
+{
+    if (length > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+    {
         return v8_new_undefined();
     }
 
-    if (value->IsBoolean())
+    auto backing_store =
+        std::make_unique<std::shared_ptr<v8::BackingStore>>(buffer->GetBackingStore());
+
+    void* data = (*backing_store)->Data()
+        ? static_cast<char*>((*backing_store)->Data()) + byte_offset
+        : nullptr;
+
+    v8_value_impl val_impl =
     {
-        return v8_new_boolean(value->BooleanValue(context->GetIsolate()));
-    }
+        new_external_buffer(
+            data,
+            length * get_element_size(type),
+            delete_backing_store,
+            backing_store.release()),
+        type,
+        type_specifiers::not_special,
+        static_cast<int32_t>(length)
+    };
 
-    if (value->IsString())
+    return to_value(val_impl);
+}
+
+js_types get_typed_array_type(v8::Local<v8::Value> value)
+{
+    if (value->IsUint8Array())
     {
-        v8::String::Utf8Value utf8(context->GetIsolate(), value);
-        return v8_new_string(*utf8, utf8.length());
+        return js_types::uint8_array;
     }
-
-    if (value->IsArray())
+    if (value->IsFloat64Array())
     {
-        v8::Array* arr = v8::Array::Cast(*value);
-        const int length = arr->Length();
-
-        v8_value res = v8_new_array(length);
-        auto data = static_cast<v8_value*>(res.data);
+        return js_types::float64_array;
+    }
+    if (value->IsFloat32Array())
+    {
+        return js_types::float32_array;
+    }
+    if (value->IsInt32Array())
+    {
+        return js_types::int32_array;
+    }
+    if (value->IsUint32Array())
+    {
+        return js_types::uint32_array;
+    }
+    if (value->IsInt8Array())
+    {
+        return js_types::int8_array;
+    }
+    if (value->IsUint8ClampedArray())
+    {
+        return js_types::uint8_clamped_array;
+    }
+    if (value->IsInt16Array())
+    {
+        return js_types::int16_array;
+    }
+    if (value->IsUint16Array())
+    {
+        return js_types::uint16_array;
+    }
+    if (value->IsBigInt64Array())
+    {
+        return js_types::big_int64_array;
+    }
+    return js_types::big_uint64_array;
+}
 
-        for (int i = 0; i < length; ++i)
-        {
-            v8::Local<v8::Value> elem;
+// Container met by the conversion and its converted value.
+// Ancestors are found by their frames, other containers
+// are kept in from_v8_state::visited_objects at index
+struct visited_object
+{
+    size_t frame;
+    uint32_t index;
+    v8_value_impl value;
+};
 
-            if (!arr->Get(context, i).ToLocal(&elem))
-            {
-                v8_delete_value(&res);
-                assert(!"invalid conversion");
-                return v8_new_undefined();
-            }
+// Container which elements are being converted. Elements of
+// an object are its own property names, elements of a set or
+// a map are read with AsArray. Map entries are laid out as
+// [k0, v0, k1, v1, ...] which matches the layout of an array
+// of v8_pair_value, so a map is converted as an array.
+// The container and its elements are kept in
+// from_v8_state::frame_objects at 2 * frame and 2 * frame + 1
+struct from_v8_frame
+{
+    bool is_object;
+    void* data;
+    int next;
+    int length;
+    int hash;
+    const visited_object* visited;
+};
 
-            data[i] = from_v8_value(context, elem);
+// State of one from_v8_value call
+struct from_v8_state
+{
+    from_v8_state(v8::Local<v8::Context> context, int flags)
+        : context(context)
+        , flags(flags)
+    {
+        if (flags & v8_convert_references)
+        {
+            visited_objects = v8::Array::New(context->GetIsolate());
         }
-
-        return res;
     }
 
-    if (value->IsSet())
+    ~from_v8_state()
     {
-        v8::Set* set = v8::Set::Cast(*value);
+        for (auto& key : keys)
+        {
+            release_shared_string(key.second);
+        }
+    }
 
-        v8::Local<v8::Array> arr = set->AsArray();
-        const int length = arr->Length();
+    from_v8_state(const from_v8_state&) = delete;
+    from_v8_state& operator=(const from_v8_state&) = delete;
 
-        v8_value res = v8_new_set(length);
-        auto data = static_cast<v8_value*>(res.data);
+    v8::Local<v8::Context> context;
+    int flags;
 
-        for (int i = 0; i < length; ++i)
-        {
-            v8::Local<v8::Value> elem;
+    // Interned object keys, each one holds a reference
+    std::unordered_map<std::string_view, shared_string*> keys;
+    std::string key_buffer;
 
-            if (!arr->Get(context, i).ToLocal(&elem))
-            {
-                v8_delete_value(&res);
-                assert(!"invalid conversion");
-                return v8_new_undefined();
-            }
+    // Containers being converted (and all converted ones with
+    // v8_convert_references) by identity hash
+    std::unordered_multimap<int, visited_object> visited;
+    v8::Local<v8::Array> visited_objects;
+    uint32_t visited_count = 0;
 
-            data[i] = from_v8_value(context, elem);
-        }
+    // Explicit stack of containers being converted, so deep
+    // values do not overflow the native stack
+    std::vector<from_v8_frame> frames;
+    // Created by the frame of the root container, so the
+    // array lives in the caller's handle scope
+    v8::Local<v8::Array> frame_objects;
 
-        return res;
-    }
+    // Set if an element of a container can't be read
+    bool failed = false;
+};
 
-    if (value->IsMap())
+v8::MaybeLocal<v8::Object> get_frame_object(from_v8_state& state, size_t frame, uint32_t offset)
+{
+    v8::Local<v8::Value> value;
+    if (!state.frame_objects->Get(state.context, static_cast<uint32_t>(frame * 2) + offset)
+        .ToLocal(&value))
     {
-        v8::Map* map = v8::Map::Cast(*value);
+        return v8::MaybeLocal<v8::Object>();
+    }
 
-        v8::Local<v8::Array> arr = map->AsArray();
-        const int length = arr->Length();
+    return value.As<v8::Object>();
+}
 
-        v8_value res = v8_new_map(length / 2);
-        auto data = static_cast<v8_pair_value*>(res.data);
+// Returns a reference to the container if it is being converted
+// or, with v8_convert_references, if it is already converted
+bool find_visited(
+    from_v8_state& state,
+    v8::Local<v8::Object> obj,
+    int hash,
+    v8_value* reference)
+{
+    const auto range = state.visited.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        v8::Local<v8::Value> visited;
 
-        for (int i = 0; i < length; i += 2)
+        if (state.visited_objects.IsEmpty())
         {
-            v8::Local<v8::Value> k;
-            if (!arr->Get(context, i).ToLocal(&k))
-            {
-                v8_delete_value(&res);
-                assert(!"invalid conversion");
-                return v8_new_undefined();
-            }
-
-            v8::Local<v8::Value> v;
-            if (!arr->Get(context, i + 1).ToLocal(&v))
+            v8::Local<v8::Object> frame_object;
+            if (!get_frame_object(state, it->second.frame, 0).ToLocal(&frame_object))
             {
-                v8_delete_value(&res);
-                assert(!"invalid conversion");
-                return v8_new_undefined();
+                return false;
             }
 
-            const auto index = i / 2;
-
-            data[index].first = from_v8_value(context, k);
-            data[index].second = from_v8_value(context, v);
+            visited = frame_object;
+        }
+        else if (!state.visited_objects->Get(state.context, it->second.index).ToLocal(&visited))
+        {
+            return false;
         }
 
-        return res;
+        if (visited == obj)
+        {
+            *reference = new_reference(it->second.value);
+            return true;
+        }
     }
 
-    if (value->IsObject())
-    {
-        v8::Object* obj = v8::Object::Cast(*value);
+    return false;
+}
+
+// Tracks the container of the top frame
+const visited_object* enter_visited(
+    from_v8_state& state,
+    v8::Local<v8::Object> obj,
+    int hash,
+    v8_value value)
+{
+    visited_object entry = { state.frames.size() - 1, 0, to_value_impl(value) };
+
+    if (!state.visited_objects.IsEmpty())
+    {
+        entry.index = state.visited_count;
+
+        if (!state.visited_objects->Set(state.context, entry.index, obj).FromMaybe(false))
+        {
+            return nullptr;
+        }
+
+        ++state.visited_count;
+    }
+
+    return &state.visited.emplace(hash, entry)->second;
+}
+
+// Without v8_convert_references only ancestors are tracked
+void leave_visited(
+    from_v8_state& state,
+    const from_v8_frame& frame)
+{
+    if (!frame.visited || !state.visited_objects.IsEmpty())
+    {
+        return;
+    }
+
+    const auto range = state.visited.equal_range(frame.hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (&it->second == frame.visited)
+        {
+            state.visited.erase(it);
+            return;
+        }
+    }
+}
+
+// Starts converting elements [first, length) of the container
+// stored to the value, the elements are set to undefined first.
+// Empty containers can't be a part of a cycle, they have no frame
+void push_frame(
+    from_v8_state& state,
+    v8::Local<v8::Object> obj,
+    v8::Local<v8::Array> elements,
+    v8_value value,
+    int first,
+    int length,
+    int hash)
+{
+    if (first >= length)
+    {
+        return;
+    }
+
+    const bool is_object = to_value_impl(value).type == js_types::object;
+
+    if (is_object)
+    {
+        auto data = static_cast<v8_pair_value*>(value.data);
+        for (int i = first; i < length; ++i)
+        {
+            set_undefined(&data[i].first);
+            set_undefined(&data[i].second);
+        }
+    }
+    else
+    {
+        auto data = static_cast<v8_value*>(value.data);
+        for (int i = first; i < length; ++i)
+        {
+            set_undefined(&data[i]);
+        }
+    }
+
+    if (state.frame_objects.IsEmpty())
+    {
+        state.frame_objects = v8::Array::New(state.context->GetIsolate());
+    }
+
+    const auto index = static_cast<uint32_t>(state.frames.size() * 2);
+
+    v8::Local<v8::Object> elements_obj = obj;
+    if (!elements.IsEmpty())
+    {
+        elements_obj = elements;
+    }
+
+    if (!state.frame_objects->Set(state.context, index, obj).FromMaybe(false)
+        || !state.frame_objects->Set(state.context, index + 1, elements_obj).FromMaybe(false))
+    {
+        state.failed = true;
+        return;
+    }
+
+    state.frames.emplace_back();
+
+    from_v8_frame& frame = state.frames.back();
+
+    frame.is_object = is_object;
+    frame.data = value.data;
+    frame.next = first;
+    frame.length = length;
+    frame.hash = hash;
+    frame.visited = enter_visited(state, obj, hash, value);
+}
+
+v8_value new_handle(v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+{
+    v8::Isolate* isolate = context->GetIsolate();
+
+    auto handle = new js_handle;
+    handle->isolate_ = isolate;
+    handle->context_.Reset(isolate, context);
+    handle->value_.Reset(isolate, value);
+
+    v8_value_impl val_impl =
+    {
+        handle,
+        js_types::handle,
+        type_specifiers::not_special,
+        0
+    };
+
+    return to_value(val_impl);
+}
+
+// Equal keys of all objects of one conversion share one string
+v8_value intern_key(from_v8_state& state, v8::Local<v8::String> key)
+{
+    v8::Isolate* isolate = state.context->GetIsolate();
+
+    const int length = key->Utf8Length(isolate);
+
+    state.key_buffer.resize(static_cast<size_t>(length));
+    key->WriteUtf8(isolate, state.key_buffer.data(), length,
+        nullptr, v8::String::NO_NULL_TERMINATION);
+
+    auto it = state.keys.find(state.key_buffer);
+    if (it == state.keys.end())
+    {
+        auto str = new shared_string;
+        str->references = 1;
+        str->data = state.key_buffer;
+        it = state.keys.emplace(str->data, str).first;
+    }
+
+    acquire_shared_string(it->second);
+
+    v8_value_impl val_impl =
+    {
+        it->second,
+        js_types::string,
+        type_specifiers::shared,
+        length
+    };
+
+    return to_value(val_impl);
+}
+
+// Elements of containers are converted in chunks, each chunk has
+// its own handle scope, so handles created for elements do not pile
+// up in the caller's scope while a large container is converted
+const int elements_chunk_size = 1024;
+
+// Calls func(index) for every index in [first, length),
+// stops and returns false when func returns false
+template <class Func>
+bool for_each_index(v8::Isolate* isolate, int first, int length, Func func)
+{
+    for (int begin = first; begin < length; begin += elements_chunk_size)
+    {
+        v8::HandleScope handle_scope(isolate);
+
+        const int end = std::min(length, begin + elements_chunk_size);
+
+        for (int i = begin; i < end; ++i)
+        {
+            if (!func(i))
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Same as v8_new_number, but integers are kept
+// integers like from_v8_value does
+v8_value number_to_value(double number)
+{
+    if (number >= std::numeric_limits<int32_t>::min()
+        && number <= std::numeric_limits<uint32_t>::max()
+        && number == static_cast<double>(static_cast<int64_t>(number))
+        && !(number == 0 && std::signbit(number)))
+    {
+        return v8_new_integer(static_cast<int64_t>(number));
+    }
+
+    return v8_new_number(number);
+}
+
+// Public V8 API does not expose elements kinds, so the array is
+// read once and stored to a packed int32_t buffer, widened to
+// double when the first non-int32 number is met. If an element is
+// not a number the array is stored as v8_array with the numbers
+// before that element and its index is returned to convert the
+// rest as usual, otherwise length is returned. Sets failed if an
+// element can't be read
+int from_v8_number_array(
+    from_v8_state& state,
+    v8::Local<v8::Array> arr,
+    int length,
+    v8_value* result)
+{
+    v8::Local<v8::Context> context = state.context;
+
+    std::unique_ptr<int32_t[]> integers(new int32_t[length]);
+    std::unique_ptr<double[]> numbers;
+
+    int not_number = length;
+
+    const bool ok = for_each_index(context->GetIsolate(), 0, length,
+        [&](int i)
+        {
+            v8::Local<v8::Value> elem;
+
+            if (!arr->Get(context, static_cast<uint32_t>(i)).ToLocal(&elem))
+            {
+                return false;
+            }
+
+            if (!numbers && elem->IsInt32())
+            {
+                integers[i] = elem.As<v8::Int32>()->Value();
+            }
+            else if (elem->IsNumber())
+            {
+                if (!numbers)
+                {
+                    numbers.reset(new double[length]);
+
+                    const int32_t* src = integers.get();
+                    double* dst = numbers.get();
+                    for (int j = 0; j < i; ++j)
+                    {
+                        dst[j] = src[j];
+                    }
+
+                    integers.reset();
+                }
+
+                numbers[i] = elem.As<v8::Number>()->Value();
+            }
+            else
+            {
+                not_number = i;
+                return false;
+            }
+
+            return true;
+        });
+
+    if (ok)
+    {
+        v8_value_impl val_impl =
+        {
+            nullptr,
+            js_types::number_array,
+            type_specifiers::number,
+            length
+        };
+
+        if (numbers)
+        {
+            val_impl.data = numbers.release();
+        }
+        else
+        {
+            val_impl.data = integers.release();
+            val_impl.specifier = type_specifiers::int32;
+        }
+
+        *result = to_value(val_impl);
+        return length;
+    }
+
+    if (not_number == length)
+    {
+        assert(!"invalid conversion");
+        state.failed = true;
+        *result = v8_new_undefined();
+        return length;
+    }
+
+    *result = v8_new_array(length);
+    auto data = static_cast<v8_value*>(result->data);
+
+    for (int j = 0; j < not_number; ++j)
+    {
+        data[j] = numbers
+            ? number_to_value(numbers[j])
+            : v8_new_integer(integers[j]);
+    }
+
+    return not_number;
+}
+
+// Converts the value to the result. A non-empty container is
+// stored with undefined elements and its frame is pushed
+void from_v8_start(
+    from_v8_state& state,
+    v8::Local<v8::Value> value,
+    v8_value* result)
+{
+    v8::Local<v8::Context> context = state.context;
+
+    if (value->IsNullOrUndefined())
+    {
+        *result = value->IsUndefined()
+            ? v8_new_undefined()
+            : v8_new_null();
+        return;
+    }
+
+    if (value->IsNumber())
+    {
+        if (value->IsUint32() || value->IsInt32())
+        {
+            v8::Integer* integer = v8::Integer::Cast(*value);
+            *result = v8_new_integer(integer->Value());
+            return;
+        }
+
+        double number;
+        if (value->NumberValue(context).To(&number))
+        {
+            *result = v8_new_number(number);
+            return;
+        }
+
+        assert(!"invalid conversion");
+        *result = v8_new_undefined();
+        return;
+    }
+
+    if (value->IsBoolean())
+    {
+        *result = v8_new_boolean(value->BooleanValue(context->GetIsolate()));
+        return;
+    }
+
+    if (value->IsBigInt())
+    {
+        v8::BigInt* big_int = v8::BigInt::Cast(*value);
+
+        bool lossless = false;
+
+        const int64_t signed_value = big_int->Int64Value(&lossless);
+        if (lossless)
+        {
+            *result = v8_new_big_int(signed_value);
+            return;
+        }
+
+        const uint64_t unsigned_value = big_int->Uint64Value(&lossless);
+        if (lossless)
+        {
+            *result = v8_new_big_uint(unsigned_value);
+            return;
+        }
+
+        v8::String::Utf8Value utf8(context->GetIsolate(), value);
+        *result = v8_new_string(*utf8, utf8.length());
+        return;
+    }
+
+    if (value->IsString())
+    {
+        v8::String::Utf8Value utf8(context->GetIsolate(), value);
+        *result = v8_new_string(*utf8, utf8.length());
+        return;
+    }
+
+    if ((state.flags & v8_convert_to_handles) && value->IsObject())
+    {
+        *result = new_handle(context, value);
+        return;
+    }
+
+    if (value->IsArray())
+    {
+        v8::Local<v8::Array> arr = value.As<v8::Array>();
+        const int length = arr->Length();
+
+        const int hash = arr->GetIdentityHash();
+        if (find_visited(state, arr, hash, result))
+        {
+            return;
+        }
+
+        int first = 0;
+
+        if (state.flags & v8_convert_number_arrays)
+        {
+            first = from_v8_number_array(state, arr, length, result);
+        }
+        else
+        {
+            *result = v8_new_array(length);
+        }
+
+        push_frame(state, arr, v8::Local<v8::Array>(), *result, first, length, hash);
+        return;
+    }
+
+    // AsArray is the only way to read entries of a Set or a Map with
+    // the public API, it makes one flat array without per-entry arrays
+    if (value->IsSet())
+    {
+        v8::Local<v8::Set> set = value.As<v8::Set>();
+
+        const int hash = set->GetIdentityHash();
+        if (find_visited(state, set, hash, result))
+        {
+            return;
+        }
+
+        v8::Local<v8::Array> arr = set->AsArray();
+        const int length = arr->Length();
+
+        *result = v8_new_set(length);
+
+        push_frame(state, set, arr, *result, 0, length, hash);
+        return;
+    }
+
+    if (value->IsMap())
+    {
+        v8::Local<v8::Map> map = value.As<v8::Map>();
+
+        const int hash = map->GetIdentityHash();
+        if (find_visited(state, map, hash, result))
+        {
+            return;
+        }
+
+        v8::Local<v8::Array> arr = map->AsArray();
+        const int length = arr->Length();
+
+        *result = v8_new_map(length / 2);
+
+        push_frame(state, map, arr, *result, 0, length, hash);
+        return;
+    }
+
+    if (value->IsArrayBuffer())
+    {
+        v8::Local<v8::ArrayBuffer> buffer = value.As<v8::ArrayBuffer>();
+        *result = from_v8_buffer(js_types::array_buffer, buffer, 0, buffer->ByteLength());
+        return;
+    }
+
+    if (value->IsTypedArray())
+    {
+        v8::Local<v8::TypedArray> arr = value.As<v8::TypedArray>();
+        *result = from_v8_buffer(
+            get_typed_array_type(value), arr->Buffer(), arr->ByteOffset(), arr->Length());
+        return;
+    }
+
+    if (value->IsObject())
+    {
+        v8::Local<v8::Object> obj = value.As<v8::Object>();
+
+        const int hash = obj->GetIdentityHash();
+        if (find_visited(state, obj, hash, result))
+        {
+            return;
+        }
+
+        v8::Local<v8::Array> names;
+        if (!obj->GetOwnPropertyNames(context).ToLocal(&names))
+        {
+            assert(!"invalid conversion");
+            *result = v8_new_undefined();
+            return;
+        }
+
+        const auto length = static_cast<int>(names->Length());
+
+        *result = v8_new_object(length);
+
+        push_frame(state, obj, names, *result, 0, length, hash);
+        return;
+    }
+
+    assert(!"Not implemented type");
+    *result = v8_new_undefined();
+}
+
+// Converts the next chunk of elements of the top frame in one
+// handle scope, stops early if an element pushes its own frame.
+// Sets failed if an element can't be read (e.g. a getter throws)
+void from_v8_step(from_v8_state& state)
+{
+    v8::Local<v8::Context> context = state.context;
+    v8::Isolate* isolate = context->GetIsolate();
 
-        v8::Local<v8::Array> names;
-        if (!obj->GetOwnPropertyNames(context).ToLocal(&names))
+    v8::HandleScope handle_scope(isolate);
+
+    const size_t top = state.frames.size() - 1;
+
+    v8::Local<v8::Object> obj;
+    v8::Local<v8::Object> elements_obj;
+
+    if (!get_frame_object(state, top, 0).ToLocal(&obj)
+        || !get_frame_object(state, top, 1).ToLocal(&elements_obj))
+    {
+        state.failed = true;
+        return;
+    }
+
+    v8::Local<v8::Array> elements = elements_obj.As<v8::Array>();
+
+    for (int n = 0; n < elements_chunk_size; ++n)
+    {
+        from_v8_frame& frame = state.frames[top];
+
+        if (frame.next == frame.length)
         {
-            assert(!"invalid conversion");
-            return v8_new_undefined();
+            leave_visited(state, frame);
+            state.frames.pop_back();
+            return;
         }
 
-        const auto length = names->Length();
+        const int i = frame.next++;
+
+        v8::Local<v8::Value> elem;
+        v8::Local<v8::Value> v;
 
-        v8_value res = v8_new_object(length);
-        auto data = static_cast<v8_pair_value*>(res.data);
+        if (!elements->Get(context, static_cast<uint32_t>(i)).ToLocal(&elem)
+            || (frame.is_object && !obj->Get(context, elem).ToLocal(&v)))
+        {
+            assert(!"invalid conversion");
+            state.failed = true;
+            return;
+        }
 
-        for (uint32_t i = 0; i < length; ++i)
+        if (frame.is_object)
         {
-            v8::Local<v8::Value> k;
-            if (!names->Get(context, i).ToLocal(&k))
+            auto& pair = static_cast<v8_pair_value*>(frame.data)[i];
+
+            if (elem->IsString())
             {
-                v8_delete_value(&res);
-                assert(!"invalid conversion");
-                return v8_new_undefined();
+                pair.first = intern_key(state, elem.As<v8::String>());
             }
-
-            v8::Local<v8::Value> v;
-            if (!obj->Get(context, k).ToLocal(&v))
+            else
             {
-                v8_delete_value(&res);
-                assert(!"invalid conversion");
-                return v8_new_undefined();
+                from_v8_start(state, elem, &pair.first);
             }
 
-            data[i].first = from_v8_value(context, k);
-            data[i].second = from_v8_value(context, v);
+            from_v8_start(state, v, &pair.second);
+        }
+        else
+        {
+            from_v8_start(state, elem, &static_cast<v8_value*>(frame.data)[i]);
+        }
+
+        if (state.frames.size() > top + 1 || state.failed)
+        {
+            return;
         }
+    }
+}
 
-        return res;
+// A value which can't be read is converted to undefined. The
+// whole value is dropped since references may point to any
+// of its containers
+v8_value from_v8(from_v8_state& state, v8::Local<v8::Value> value)
+{
+    v8_value result;
+    from_v8_start(state, value, &result);
+
+    while (!state.frames.empty() && !state.failed)
+    {
+        from_v8_step(state);
     }
 
-    assert(!"Not implemented type");
-    return v8_new_undefined();
+    if (state.failed)
+    {
+        state.frames.clear();
+        state.visited.clear();
+
+        v8_delete_value(&result);
+        return v8_new_undefined();
+    }
+
+    return result;
 }
 
-v8::Local<v8::Value> to_v8_value(v8::Local<v8::Context> context, v8_value value)
+v8_value from_v8_value(v8::Local<v8::Context> context, v8::Local<v8::Value> value)
+{
+    return from_v8_value(context, value, get_conversion_flags(context->GetIsolate()));
+}
+
+v8_value from_v8_value(v8::Local<v8::Context> context, v8::Local<v8::Value> value, int flags)
+{
+    from_v8_state state(context, flags);
+    return from_v8(state, value);
+}
+
+template <class Resource, class Base>
+v8::MaybeLocal<v8::String> new_external_string(
+    v8::Isolate* isolate,
+    external_buffer* buffer,
+    v8::MaybeLocal<v8::String> (*factory)(v8::Isolate*, Base*))
+{
+    auto resource = new Resource(buffer);
+
+    v8::MaybeLocal<v8::String> result = factory(isolate, resource);
+
+    // V8 takes ownership of the resource only on success
+    if (result.IsEmpty())
+    {
+        delete resource;
+    }
+
+    return result;
+}
+
+v8::MaybeLocal<v8::String> new_v8_string(v8::Isolate* isolate, v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    switch (val_impl.specifier)
+    {
+    case type_specifiers::external_one_byte:
+        return new_external_string<external_one_byte_resource>(
+            isolate,
+            static_cast<external_buffer*>(val_impl.data),
+            &v8::String::NewExternalOneByte);
+    case type_specifiers::external_two_byte:
+        return new_external_string<external_two_byte_resource>(
+            isolate,
+            static_cast<external_buffer*>(val_impl.data),
+            &v8::String::NewExternalTwoByte);
+    default:
+        break;
+    }
+
+    const auto str = v8_to_string(&value);
+    return v8::String::NewFromUtf8(
+        isolate, str.data, v8::NewStringType::kNormal, str.size);
+}
+
+void release_backing_store(void* /*data*/, size_t /*length*/, void* deleter_data)
+{
+    release_external_buffer(static_cast<external_buffer*>(deleter_data));
+}
+
+// The backing store refers to the caller-owned memory and
+// holds a reference to it until V8 frees the backing store
+v8::Local<v8::ArrayBuffer> new_v8_array_buffer(v8::Isolate* isolate, v8_value_impl val_impl)
+{
+    auto buffer = static_cast<external_buffer*>(val_impl.data);
+
+    acquire_external_buffer(buffer);
+
+    std::unique_ptr<v8::BackingStore> backing_store =
+        v8::ArrayBuffer::NewBackingStore(
+            buffer->data, buffer->size, release_backing_store, buffer);
+
+    return v8::ArrayBuffer::New(isolate, std::move(backing_store));
+}
+
+// Converted containers, references are resolved to them
+struct converted_container
+{
+    const void* data;
+    v8::Local<v8::Value> value;
+};
+
+// Container which elements are being converted by to_v8.
+// Elements of a map are its keys and values in turn
+struct to_v8_frame
+{
+    v8_value value;
+    int next;
+    int length;
+    size_t container;
+    bool failed;
+
+    // Object, set or map which is filled, arrays
+    // are created once all elements are converted
+    v8::Local<v8::Value> target;
+    v8::Local<v8::Value> key;
+    std::unique_ptr<v8::Local<v8::Value>[]> elements;
+};
+
+struct to_v8_state
+{
+    explicit to_v8_state(v8::Local<v8::Context> context)
+        : context(context)
+    {
+    }
+
+    v8::Local<v8::Context> context;
+
+    // Containers are listed as they are met, an array is listed
+    // without a value until its elements are converted. The
+    // index of the list is built only if there are references
+    std::vector<converted_container> containers;
+    std::unordered_map<const void*, size_t> index;
+    size_t indexed = 0;
+
+    // Explicit stack of containers being converted, so deep
+    // values do not overflow the native stack
+    std::vector<to_v8_frame> frames;
+};
+
+v8::Local<v8::Value> to_v8(to_v8_state& state, v8_value value);
+
+// Empty containers have no data and can't refer to
+// themselves, they are not listed
+size_t add_container(to_v8_state& state, v8_value_impl val_impl, v8::Local<v8::Value> value)
+{
+    if (val_impl.size > 0)
+    {
+        state.containers.push_back({ val_impl.data, value });
+    }
+    return state.containers.size() - 1;
+}
+
+v8::Local<v8::Value> resolve_reference(to_v8_state& state, v8_value value)
+{
+    const auto val_impl = to_value_impl(value);
+
+    for (; state.indexed < state.containers.size(); ++state.indexed)
+    {
+        state.index.emplace(state.containers[state.indexed].data, state.indexed);
+    }
+
+    const auto it = state.index.find(val_impl.data);
+
+    // Refers to a value which is not a part of the converted one
+    if (it == state.index.end())
+    {
+        return to_v8(state, v8_resolve_reference(value));
+    }
+
+    auto& container = state.containers[it->second];
+
+    // An array refers to itself, so it is created before
+    // its elements are converted
+    if (container.value.IsEmpty())
+    {
+        container.value = v8::Array::New(state.context->GetIsolate(), val_impl.size);
+    }
+
+    return container.value;
+}
+
+// Adds a frame for the elements of the container, the
+// container of an array is listed without a value
+void push_frame(to_v8_state& state, v8_value value, int length, v8::Local<v8::Value> target)
+{
+    const auto val_impl = to_value_impl(value);
+
+    to_v8_frame frame;
+    frame.value = value;
+    frame.next = 0;
+    frame.length = length;
+    frame.container = 0;
+    frame.failed = false;
+    frame.target = target;
+
+    if (val_impl.type == js_types::array)
+    {
+        frame.container = add_container(state, val_impl, v8::Local<v8::Value>());
+        frame.elements.reset(new v8::Local<v8::Value>[length]);
+    }
+
+    state.frames.push_back(std::move(frame));
+}
+
+v8_value get_element(const to_v8_frame& frame)
+{
+    const auto val_impl = to_value_impl(frame.value);
+
+    switch (val_impl.type)
+    {
+    case js_types::object:
+        if (val_impl.specifier == type_specifiers::shaped)
+        {
+            return v8_to_shaped_object(frame.value).data[frame.next];
+        }
+        return v8_to_object(frame.value).data[frame.next].second;
+    case js_types::map:
+    {
+        const auto& pair = v8_to_map(frame.value).data[frame.next / 2];
+        return frame.next % 2 == 0
+            ? pair.first
+            : pair.second;
+    }
+    default:
+        return static_cast<v8_value*>(frame.value.data)[frame.next];
+    }
+}
+
+// Puts the converted element to the container of the frame
+void add_element(to_v8_state& state, to_v8_frame& frame, v8::Local<v8::Value> element)
+{
+    v8::Local<v8::Context> context = state.context;
+    v8::Isolate* isolate = context->GetIsolate();
+
+    const auto val_impl = to_value_impl(frame.value);
+
+    const int i = frame.next++;
+
+    switch (val_impl.type)
+    {
+    case js_types::object:
+    {
+        v8::Local<v8::String> name;
+        if (val_impl.specifier == type_specifiers::shaped)
+        {
+            // Keys are cached internalized strings which are always added
+            // in the same order, so V8 follows the same map transitions and
+            // all objects of a shape share one hidden class
+            const auto obj = v8_to_shaped_object(frame.value);
+
+            assert(obj.shape->isolate_ == isolate);
+
+            name = v8::Local<v8::String>::New(isolate, obj.shape->keys_[i]);
+        }
+        else
+        {
+            const auto str = v8_to_string(&v8_to_object(frame.value).data[i].first);
+
+            if (!v8::String::NewFromUtf8(
+                isolate, str.data, v8::NewStringType::kNormal, str.size).ToLocal(&name))
+            {
+                assert(!"Invalid string conversion");
+                frame.failed = true;
+                return;
+            }
+        }
+
+        if (!frame.target.As<v8::Object>()->CreateDataProperty(
+            context, name, element).FromMaybe(false))
+        {
+            assert(!"Failed to create object property");
+            frame.failed = true;
+        }
+        return;
+    }
+    case js_types::set:
+        if (frame.target.As<v8::Set>()->Add(context, element).IsEmpty())
+        {
+            assert(!"Failed to insert into set");
+            frame.failed = true;
+        }
+        return;
+    case js_types::map:
+        if (i % 2 == 0)
+        {
+            frame.key = element;
+        }
+        else if (frame.target.As<v8::Map>()->Set(context, frame.key, element).IsEmpty())
+        {
+            assert(!"Failed to insert into map");
+            frame.failed = true;
+        }
+        return;
+    default:
+        frame.elements[i] = element;
+        return;
+    }
+}
+
+// Returns the converted container once all elements are added.
+// An array is created with all elements at once unless it is
+// already created because it refers to itself
+v8::Local<v8::Value> finish_frame(to_v8_state& state, to_v8_frame& frame)
 {
+    v8::Local<v8::Context> context = state.context;
     v8::Isolate* isolate = context->GetIsolate();
 
-    v8::EscapableHandleScope handle_scope(isolate);
+    if (to_value_impl(frame.value).type != js_types::array)
+    {
+        return frame.failed
+            ? v8::Local<v8::Value>(v8::Undefined(isolate))
+            : frame.target;
+    }
+
+    auto& container = state.containers[frame.container];
+
+    if (container.value.IsEmpty())
+    {
+        container.value = v8::Array::New(
+            isolate, frame.elements.get(), static_cast<size_t>(frame.length));
+        return container.value;
+    }
+
+    v8::Local<v8::Object> val = container.value.As<v8::Object>();
+    for (int i = 0; i < frame.length; ++i)
+    {
+        if (!val->Set(context, static_cast<uint32_t>(i), frame.elements[i]).FromMaybe(false))
+        {
+            assert(!"Failed to set array element");
+            return v8::Undefined(isolate);
+        }
+    }
+    return val;
+}
 
-    v8::Local<v8::Value> result;
+// Converts the value, a non-empty container gets a frame
+// and an empty handle is returned
+v8::Local<v8::Value> to_v8_start(to_v8_state& state, v8_value value)
+{
+    v8::Local<v8::Context> context = state.context;
+    v8::Isolate* isolate = context->GetIsolate();
 
     const auto val_impl = to_value_impl(value);
 
     switch (val_impl.type)
     {
     case js_types::undefined:
-        return handle_scope.Escape(v8::Undefined(isolate));
+        return v8::Undefined(isolate);
     case js_types::boolean:
         return v8_to_bool(value)
-            ? handle_scope.Escape(v8::True(isolate))
-            : handle_scope.Escape(v8::False(isolate));
+            ? v8::True(isolate)
+            : v8::False(isolate);
     case js_types::null:
-        return handle_scope.Escape(v8::Null(isolate));
+        return v8::Null(isolate);
     case js_types::number:
         switch (val_impl.specifier)
         {
-        case type_specifiers::not_special:
+        default:
             assert(!"Invalid value");
-            return handle_scope.Escape(v8::Undefined(isolate));
+            return v8::Undefined(isolate);
         case type_specifiers::number:
-            return handle_scope.Escape(v8::Number::New(isolate, v8_to_double(value)));
+            return v8::Number::New(isolate, v8_to_double(value));
         case type_specifiers::int64:
-            // TODO maybe BigInt?
-            return handle_scope.Escape(v8::Number::New(isolate, v8_to_double(value)));
+            // Numbers stay numbers, v8_new_big_int is for lossless 64-bit integers
+            return v8::Number::New(isolate, v8_to_double(value));
         case type_specifiers::int32:
-            return handle_scope.Escape(v8::Integer::New(isolate, v8_to_int32(value)));
+            return v8::Integer::New(isolate, v8_to_int32(value));
         case type_specifiers::uint32:
-            return handle_scope.Escape(v8::Integer::NewFromUnsigned(isolate, v8_to_uint32(value)));
+            return v8::Integer::NewFromUnsigned(isolate, v8_to_uint32(value));
         }
         break;
     case js_types::string:
     {
-        const auto str = v8_to_string(&value);
         v8::Local<v8::String> val;
-        if (!v8::String::NewFromUtf8(
-            isolate, str.data, v8::NewStringType::kNormal, str.size).ToLocal(&val))
+        if (!new_v8_string(isolate, value).ToLocal(&val))
         {
             assert(!"Invalid string conversion");
-            return handle_scope.Escape(v8::Undefined(isolate));
+            return v8::Undefined(isolate);
         }
-        return handle_scope.Escape(val);
+        return val;
     }
     case js_types::big_int:
-        assert(!"not implemented");
-        break;
+        return val_impl.specifier == type_specifiers::uint64
+            ? v8::BigInt::NewFromUnsigned(isolate, v8_to_uint64(value))
+            : v8::BigInt::New(isolate, v8_to_int64(value));
     case js_types::symbol:
         assert(!"not implemented");
         break;
     case js_types::object:
     {
-        const auto obj = v8_to_object(value);
-        v8::Local<v8::Object> val = v8::Object::New(isolate);
-        for (int i = 0; i < obj.size; ++i)
+        if (val_impl.size == 0)
         {
-            const auto str = v8_to_string(&obj.data[i].first);
-
-            v8::Local<v8::String> name;
-            if (!v8::String::NewFromUtf8(
-                isolate, str.data, v8::NewStringType::kNormal, str.size).ToLocal(&name))
-            {
-                assert(!"Invalid string conversion");
-                return handle_scope.Escape(v8::Undefined(isolate));
-            }
+            return v8::Object::New(isolate);
+        }
 
-            if (!val->CreateDataProperty(context,
-                name,
-                to_v8_value(context, obj.data[i].second)).ToChecked())
-            {
-                assert(!"Failed to create object property");
-                return handle_scope.Escape(v8::Undefined(isolate));
-            }
+        v8::Local<v8::Object> val = v8::Object::New(isolate);
+        if (val_impl.specifier != type_specifiers::shaped)
+        {
+            add_container(state, val_impl, val);
         }
-        return handle_scope.Escape(val);
+        push_frame(state, value, val_impl.size, val);
+        return v8::Local<v8::Value>();
     }
     case js_types::array:
-    {
-        const auto arr = v8_to_array(value);
-        v8::Local<v8::Array> val = v8::Array::New(isolate, arr.size);
-        for (int i = 0; i < arr.size; ++i)
+        if (val_impl.size == 0)
         {
-            if (!val->Set(context, i, to_v8_value(context, arr.data[i])).ToChecked())
-            {
-                assert(!"Failed to add array element");
-                return handle_scope.Escape(v8::Undefined(isolate));
-            }
+            return v8::Array::New(isolate);
         }
-        return handle_scope.Escape(val);
-    }
+        push_frame(state, value, val_impl.size, v8::Local<v8::Value>());
+        return v8::Local<v8::Value>();
     case js_types::set:
     {
-        const auto set = v8_to_set(value);
-        v8::Local<v8::Set> val = v8::Set::New(isolate);
-        for (int i = 0; i < set.size; ++i)
+        if (val_impl.size == 0)
         {
-            v8::MaybeLocal<v8::Set> tmp =
-                val->Add(context, to_v8_value(context, set.data[i]));
-            if (!tmp.ToLocal(&val))
-            {
-                assert(!"Failed to insert into set");
-                return handle_scope.Escape(v8::Undefined(isolate));
-            }
+            return v8::Set::New(isolate);
         }
-        return handle_scope.Escape(val);
+
+        v8::Local<v8::Set> val = v8::Set::New(isolate);
+        add_container(state, val_impl, val);
+        push_frame(state, value, val_impl.size, val);
+        return v8::Local<v8::Value>();
     }
     case js_types::map:
     {
-        const auto map = v8_to_map(value);
-        v8::Local<v8::Map> val = v8::Map::New(isolate);
-        for (int i = 0; i < map.size; ++i)
+        if (val_impl.size == 0)
         {
-            v8::MaybeLocal<v8::Map> tmp = val->Set(context,
-                to_v8_value(context, map.data[i].first),
-                to_v8_value(context, map.data[i].second));
-            if (!tmp.ToLocal(&val))
-            {
-                assert(!"Failed to insert into map");
-                return handle_scope.Escape(v8::Undefined(isolate));
-            }
+            return v8::Map::New(isolate);
         }
-        return handle_scope.Escape(val);
+
+        v8::Local<v8::Map> val = v8::Map::New(isolate);
+        add_container(state, val_impl, val);
+        push_frame(state, value, val_impl.size * 2, val);
+        return v8::Local<v8::Value>();
     }
     case js_types::function:
         assert(!"not implemented");
@@ -803,7 +2473,131 @@ v8::Local<v8::Value> to_v8_value(v8::Local<v8::Context> context, v8_value value)
     case js_types::date:
         assert(!"not implemented");
         break;
+    case js_types::array_buffer:
+        return new_v8_array_buffer(isolate, val_impl);
+    case js_types::int8_array:
+        return v8::Int8Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::uint8_array:
+        return v8::Uint8Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::uint8_clamped_array:
+        return v8::Uint8ClampedArray::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::int16_array:
+        return v8::Int16Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::uint16_array:
+        return v8::Uint16Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::int32_array:
+        return v8::Int32Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::uint32_array:
+        return v8::Uint32Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::float32_array:
+        return v8::Float32Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::float64_array:
+        return v8::Float64Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::big_int64_array:
+        return v8::BigInt64Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::big_uint64_array:
+        return v8::BigUint64Array::New(
+            new_v8_array_buffer(isolate, val_impl), 0, val_impl.size);
+    case js_types::reference:
+        return resolve_reference(state, value);
+    case js_types::handle:
+    {
+        auto handle = static_cast<js_handle*>(val_impl.data);
+        assert(handle->isolate_ == isolate);
+        return v8::Local<v8::Value>::New(isolate, handle->value_);
+    }
+    case js_types::number_array:
+    {
+        const auto arr = v8_to_number_array(value);
+        std::unique_ptr<v8::Local<v8::Value>[]> elements(
+            new v8::Local<v8::Value>[arr.size]);
+        if (arr.integers)
+        {
+            for (int i = 0; i < arr.size; ++i)
+            {
+                elements[i] = v8::Integer::New(isolate, arr.integers[i]);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < arr.size; ++i)
+            {
+                elements[i] = v8::Number::New(isolate, arr.numbers[i]);
+            }
+        }
+        return v8::Array::New(isolate, elements.get(), static_cast<size_t>(arr.size));
+    }
     }
 
-    return handle_scope.Escape(v8::Undefined(isolate));
+    return v8::Undefined(isolate);
+}
+
+v8::Local<v8::Value> to_v8(to_v8_state& state, v8_value value)
+{
+    const size_t depth = state.frames.size();
+
+    v8::Local<v8::Value> result = to_v8_start(state, value);
+
+    while (state.frames.size() > depth)
+    {
+        const size_t top = state.frames.size() - 1;
+
+        if (state.frames[top].next < state.frames[top].length)
+        {
+            v8::Local<v8::Value> element = to_v8_start(state, get_element(state.frames[top]));
+            if (!element.IsEmpty())
+            {
+                add_element(state, state.frames[top], element);
+            }
+            continue;
+        }
+
+        v8::Local<v8::Value> container = finish_frame(state, state.frames[top]);
+
+        state.frames.pop_back();
+
+        if (state.frames.size() > depth)
+        {
+            add_element(state, state.frames.back(), container);
+        }
+        else
+        {
+            result = container;
+        }
+    }
+
+    return result;
+}
+
+v8::Local<v8::Value> to_v8_value(v8::Local<v8::Context> context, v8_value value)
+{
+    v8::EscapableHandleScope handle_scope(context->GetIsolate());
+
+    to_v8_state state(context);
+
+    return handle_scope.Escape(to_v8(state, value));
+}
+
+void to_v8_values(
+    v8::Local<v8::Context> context,
+    int count,
+    const v8_value* values,
+    v8::Local<v8::Value>* result)
+{
+    to_v8_state state(context);
+
+    for (int i = 0; i < count; ++i)
+    {
+        result[i] = to_v8(state, values[i]);
+    }
 }
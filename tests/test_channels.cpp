@@ -0,0 +1,106 @@
+﻿#include <gtest/gtest.h>
+
+#include "../include/v8capi.h"
+
+#include "isolate_fixture.h"
+
+TEST_F(IsolateFixture, Channels)
+{
+    EXPECT_EQ(v8_new_channel(8, 3), nullptr);
+    EXPECT_EQ(v8_new_channel(0, 4), nullptr);
+
+    v8_channel* channel = v8_new_channel(sizeof(double), 4);
+
+    ASSERT_NE(channel, nullptr);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "const header = new Int32Array(channel, 0, 32);"
+        "const capacity = header[2];"
+        "const records = new Float64Array(channel, 128, capacity);"
+        "function drain() {"
+        "    const head = Atomics.load(header, 0);"
+        "    let tail = Atomics.load(header, 16);"
+        "    let sum = 0;"
+        "    while (tail !== head) {"
+        "        sum += records[tail & (capacity - 1)];"
+        "        tail = (tail + 1) | 0;"
+        "    }"
+        "    Atomics.store(header, 16, tail);"
+        "    return sum;"
+        "}",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    bool ok = v8_attach_channel(script, "channel", channel, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_value res;
+
+    ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* drain = v8_get_function(script, "drain");
+
+    ASSERT_NE(drain, nullptr);
+
+    const double first[] = { 1.5, 2.5, 3 };
+
+    for (double record : first)
+    {
+        EXPECT_TRUE(v8_channel_write(channel, &record));
+    }
+
+    EXPECT_EQ(v8_channel_size(channel), 3);
+
+    ok = v8_call_function(drain, 0, nullptr, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_double(res), 7);
+    EXPECT_EQ(v8_channel_size(channel), 0);
+
+    v8_delete_value(&res);
+
+    // The records wrap around
+    const double second[] = { 1, 2, 3, 4 };
+
+    for (double record : second)
+    {
+        EXPECT_TRUE(v8_channel_write(channel, &record));
+    }
+
+    const double extra = 5;
+
+    EXPECT_FALSE(v8_channel_write(channel, &extra));
+
+    ok = v8_call_function(drain, 0, nullptr, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_double(res), 10);
+
+    v8_delete_value(&res);
+
+    EXPECT_TRUE(v8_channel_write(channel, &extra));
+
+    v8_delete_channel(channel);
+
+    // JS still refers to the buffer
+    ok = v8_call_function(drain, 0, nullptr, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_double(res), 5);
+
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_function(drain);
+    v8_delete_script(script);
+}
@@ -0,0 +1,219 @@
+﻿#include <string>
+
+#include <gtest/gtest.h>
+
+#include <v8.h>
+
+#include "../include/v8capi.h"
+
+namespace
+{
+    struct counter
+    {
+        int64_t value;
+    };
+
+    void* counter_new(int argc, const v8_value* argv, void*)
+    {
+        return new counter{ argc > 0 ? v8_to_int64(argv[0]) : 0 };
+    }
+
+    bool counter_add(void* self, int argc, const v8_value* argv, v8_value* result, void*)
+    {
+        auto c = static_cast<counter*>(self);
+
+        for (int i = 0; i < argc; ++i)
+        {
+            c->value += v8_to_int64(argv[i]);
+        }
+
+        *result = v8_new_integer(c->value);
+        return true;
+    }
+
+    bool counter_get(void* self, v8_value* result, void*)
+    {
+        *result = v8_new_integer(static_cast<counter*>(self)->value);
+        return true;
+    }
+
+    bool counter_set(void* self, v8_value value, v8_value* message, void*)
+    {
+        if (!v8_is_number(value))
+        {
+            *message = v8_new_string("not a number", 12);
+            return false;
+        }
+
+        static_cast<counter*>(self)->value = v8_to_int64(value);
+        return true;
+    }
+
+    void counter_delete(void* self, void* userdata)
+    {
+        ++*static_cast<int*>(userdata);
+        delete static_cast<counter*>(self);
+    }
+}
+
+TEST(NativeClasses, NativeClasses)
+{
+    v8_isolate* vm = v8_new_isolate();
+
+    int finalized = 0;
+
+    const v8_method_def methods[] =
+    {
+        { "add", counter_add }
+    };
+
+    const v8_accessor_def accessors[] =
+    {
+        { "value", counter_get, counter_set }
+    };
+
+    v8_class_def def =
+    {
+        "Counter",
+        counter_new,
+        counter_delete,
+        methods, 1,
+        accessors, 1,
+        &finalized
+    };
+
+    v8_class* cls = v8_register_class(vm, &def);
+
+    ASSERT_NE(cls, nullptr);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "const c = new Counter(5);"
+        "c.add(2);"
+        "c.value = 10;"
+        "let e; try { c.value = 'x' } catch (err) { e = err.message }"
+        "let f; try { Counter.prototype.add.call({}, 1) } catch (err) { f = err instanceof TypeError }"
+        "function get(x) { return x.value }"
+        "[c.add(1), c.value, e, f]",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_array(res));
+
+    v8_array_value arr = v8_to_array(res);
+
+    ASSERT_EQ(arr.size, 4);
+
+    EXPECT_EQ(v8_to_int32(arr.data[0]), 11);
+    EXPECT_EQ(v8_to_int32(arr.data[1]), 11);
+    EXPECT_EQ(std::string(v8_to_string(&arr.data[2]).data), "not a number");
+    EXPECT_TRUE(v8_to_bool(arr.data[3]));
+
+    v8_delete_value(&res);
+
+    auto native = new counter{ 42 };
+
+    v8_value handle;
+
+    ok = v8_new_native_object(script, cls, native, &handle, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_get_native_object(handle, cls), native);
+
+    v8_callable* get = v8_get_function(script, "get");
+
+    ASSERT_NE(get, nullptr);
+
+    ok = v8_call_function(get, 1, &handle, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 42);
+
+    v8_delete_value(&res);
+    v8_delete_value(&handle);
+    v8_delete_function(get);
+    v8_delete_error(&err);
+    v8_delete_script(script);
+
+    v8_delete_isolate(vm);
+
+    EXPECT_EQ(finalized, 2);
+}
+
+TEST(NativeClasses, GarbageCollection)
+{
+    // Makes gc() available to scripts of VMs created after the call
+    v8::V8::SetFlagsFromString("--expose-gc");
+
+    v8_isolate* vm = v8_new_isolate();
+
+    int finalized = 0;
+
+    v8_class_def def =
+    {
+        "Counter",
+        counter_new,
+        counter_delete,
+        nullptr, 0,
+        nullptr, 0,
+        &finalized
+    };
+
+    v8_class* cls = v8_register_class(vm, &def);
+
+    ASSERT_NE(cls, nullptr);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "for (let i = 0; i < 10; ++i) { new Counter(i) }"
+        "gc()",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_delete_value(&res);
+
+    v8_poll(vm);
+
+    EXPECT_EQ(finalized, 10);
+
+    auto native = new counter{ 1 };
+
+    v8_value handle;
+
+    ok = v8_new_native_object(script, cls, native, &handle, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_value other;
+
+    ok = v8_new_native_object(script, cls, native, &other, &err);
+
+    EXPECT_FALSE(ok);
+    EXPECT_NE(err.message, nullptr);
+
+    v8_delete_value(&handle);
+    v8_delete_error(&err);
+    v8_delete_script(script);
+
+    v8_delete_isolate(vm);
+
+    EXPECT_EQ(finalized, 11);
+}
@@ -1,3 +1,5 @@
+#include <limits>
+
 #include <gtest/gtest.h>
 
 #include "utils.h"
@@ -306,3 +308,614 @@ TEST_F(IsolateFixture, MapConversion)
     v8_delete_error(&err);
     v8_delete_script(script);
 }
+
+TEST_F(IsolateFixture, BigIntConversion)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function check(x, y) {\n"
+        "    return x === -9223372036854775808n && y === 18446744073709551615n\n"
+        "}\n"
+        "[ 9007199254740993n, -2n, 18446744073709551615n, 2n ** 64n ]",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_array(res));
+
+    v8_array_value arr = v8_to_array(res);
+
+    ASSERT_EQ(arr.size, 4);
+
+    ASSERT_TRUE(v8_is_big_int(arr.data[0]));
+    EXPECT_EQ(v8_to_int64(arr.data[0]), 9007199254740993);
+
+    ASSERT_TRUE(v8_is_big_int(arr.data[1]));
+    EXPECT_EQ(v8_to_int64(arr.data[1]), -2);
+
+    ASSERT_TRUE(v8_is_big_int(arr.data[2]));
+    EXPECT_EQ(v8_to_uint64(arr.data[2]), std::numeric_limits<uint64_t>::max());
+
+    ASSERT_TRUE(v8_is_string(arr.data[3]));
+    EXPECT_STREQ(v8_to_string(&arr.data[3]).data, "18446744073709551616");
+
+    v8_delete_value(&res);
+
+    v8_callable* check = v8_get_function(script, "check");
+
+    ASSERT_NE(check, nullptr);
+
+    v8_value args[] =
+    {
+        v8_new_big_int(std::numeric_limits<int64_t>::min()),
+        v8_new_big_uint(std::numeric_limits<uint64_t>::max())
+    };
+
+    ok = v8_call_function(check, 2, args, &res, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_TRUE(v8_to_bool(res));
+
+    EXPECT_EQ(v8_to_int64(v8_new_big_uint(42)), 42);
+
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_function(check);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, ExternalStringConversion)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function check(a, b) { return a === 'external latin-1 string' && b === 'external utf-16 string' }",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* check = v8_get_function(script, "check");
+
+    ASSERT_NE(check, nullptr);
+
+    const std::string a = "external latin-1 string";
+    const std::u16string b = u"external utf-16 string";
+
+    v8_value args[] =
+    {
+        v8_new_external_string(
+            a.c_str(), static_cast<int32_t>(a.length()), nullptr, nullptr),
+        v8_new_external_string16(
+            reinterpret_cast<const uint16_t*>(b.c_str()),
+            static_cast<int32_t>(b.length()),
+            nullptr,
+            nullptr)
+    };
+
+    ok = v8_call_function(check, 2, args, &res, &err);
+
+    EXPECT_TRUE(ok) << err.message;
+
+    EXPECT_TRUE(v8_is_boolean(res));
+    EXPECT_TRUE(v8_to_bool(res));
+
+    v8_delete_value(&args[0]);
+    v8_delete_value(&args[1]);
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_function(check);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, TypedArrayConversion)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function fill(a) { for (let i = 0; i < a.length; ++i) a[i] = i * 2; return a.buffer.byteLength }\n"
+        "new Float64Array([ 1.5, 2.5, 3.5 ])",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_EQ(v8_get_value_type(res), v8_float64_array);
+
+    v8_buffer_value arr = v8_to_typed_array(res);
+
+    ASSERT_EQ(arr.size, 3);
+
+    EXPECT_EQ(static_cast<double*>(arr.data)[0], 1.5);
+    EXPECT_EQ(static_cast<double*>(arr.data)[1], 2.5);
+    EXPECT_EQ(static_cast<double*>(arr.data)[2], 3.5);
+
+    v8_delete_value(&res);
+
+    v8_callable* fill = v8_get_function(script, "fill");
+
+    ASSERT_NE(fill, nullptr);
+
+    int32_t data[4] = {};
+
+    v8_value arg = v8_new_typed_array(v8_int32_array, data, 4, nullptr, nullptr);
+
+    ok = v8_call_function(fill, 1, &arg, &res, &err);
+
+    EXPECT_TRUE(ok) << err.message;
+
+    EXPECT_EQ(v8_to_int32(res), 16);
+
+    EXPECT_EQ(data[0], 0);
+    EXPECT_EQ(data[1], 2);
+    EXPECT_EQ(data[2], 4);
+    EXPECT_EQ(data[3], 6);
+
+    v8_delete_value(&arg);
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_function(fill);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, NumberArrayConversion)
+{
+    v8_set_conversion_flags(vm, v8_convert_number_arrays);
+
+    v8_error err;
+
+    v8_script* script =
+        v8_compile_script(vm, "[ 1, 2, 3 ]", "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_number_array(res));
+
+    v8_number_array_value arr = v8_to_number_array(res);
+
+    ASSERT_EQ(arr.size, 3);
+    ASSERT_NE(arr.integers, nullptr);
+
+    EXPECT_EQ(arr.integers[0], 1);
+    EXPECT_EQ(arr.integers[1], 2);
+    EXPECT_EQ(arr.integers[2], 3);
+
+    v8_delete_script(script);
+
+    script =
+        v8_compile_script(vm, read_file("check_conversions.js").c_str(), "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value skip;
+
+    ok = v8_run_script(script, &skip, &err);
+
+    v8_delete_value(&skip);
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* check = v8_get_function(script, "check_arr");
+
+    ASSERT_NE(check, nullptr);
+
+    ok = v8_call_function(check, 1, &res, &skip, &err);
+
+    EXPECT_TRUE(ok) << err.message;
+
+    v8_delete_function(check);
+    v8_delete_value(&skip);
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_script(script);
+
+    script =
+        v8_compile_script(vm, "[ 1, 2.5, 3 ]", "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    ok = v8_run_script(script, &res, &err);
+
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_number_array(res));
+
+    EXPECT_FALSE(v8_is_double(res));
+
+    arr = v8_to_number_array(res);
+
+    ASSERT_EQ(arr.size, 3);
+    ASSERT_NE(arr.numbers, nullptr);
+
+    EXPECT_EQ(arr.numbers[0], 1);
+    EXPECT_EQ(arr.numbers[1], 2.5);
+    EXPECT_EQ(arr.numbers[2], 3);
+
+    v8_delete_value(&res);
+    v8_delete_script(script);
+
+    script =
+        v8_compile_script(vm, "[ 1, 2.5, 'x' ]", "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    ok = v8_run_script(script, &res, &err);
+
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_array(res));
+
+    v8_array_value mixed = v8_to_array(res);
+
+    ASSERT_EQ(mixed.size, 3);
+
+    EXPECT_TRUE(v8_is_integer(mixed.data[0]));
+    EXPECT_EQ(v8_to_int32(mixed.data[0]), 1);
+
+    EXPECT_TRUE(v8_is_double(mixed.data[1]));
+    EXPECT_EQ(v8_to_double(mixed.data[1]), 2.5);
+
+    EXPECT_TRUE(v8_is_string(mixed.data[2]));
+    EXPECT_STREQ(v8_to_string(&mixed.data[2]).data, "x");
+
+    v8_delete_value(&res);
+    v8_delete_script(script);
+
+#ifdef NDEBUG
+    // A failed read drops the whole value, not only the array
+    script = v8_compile_script(vm,
+        "const a = [ 1, 2, 3 ];"
+        "Object.defineProperty(a, 1, { get() { throw new Error('x') } });"
+        "({ numbers: a, other: [ 4, 5 ] })",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    ok = v8_run_script(script, &res, &err);
+
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_TRUE(v8_is_undefined(res));
+
+    v8_delete_value(&res);
+    v8_delete_script(script);
+#endif
+}
+
+TEST_F(IsolateFixture, LargeContainersConversion)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "const m = new Map()\n"
+        "for (let i = 0; i < 3000; ++i) m.set(i, 'value ' + i)\n"
+        "m",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_map(res));
+
+    v8_map_value map = v8_to_map(res);
+
+    ASSERT_EQ(map.size, 3000);
+
+    for (int i = 0; i < map.size; ++i)
+    {
+        ASSERT_TRUE(v8_is_integer(map.data[i].first));
+        EXPECT_EQ(v8_to_int32(map.data[i].first), i);
+
+        ASSERT_TRUE(v8_is_string(map.data[i].second));
+        EXPECT_EQ(v8_to_string(&map.data[i].second).data, "value " + std::to_string(i));
+    }
+
+    v8_delete_value(&res);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, ShapedObjectConversion)
+{
+    const char* keys[] = { "id", "name" };
+
+    v8_object_shape* shape = v8_new_object_shape(vm, 2, keys);
+
+    ASSERT_NE(shape, nullptr);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function check(a, b) {\n"
+        "    return a.id === 1 && a.name === 'first'\n"
+        "        && b.id === 2 && b.name === undefined\n"
+        "        && Object.keys(b).join() === 'id,name'\n"
+        "}",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* check = v8_get_function(script, "check");
+
+    ASSERT_NE(check, nullptr);
+
+    v8_value args[] =
+    {
+        v8_new_shaped_object(shape),
+        v8_new_shaped_object(shape)
+    };
+
+    EXPECT_TRUE(v8_is_object(args[0]));
+    EXPECT_TRUE(v8_is_shaped_object(args[0]));
+
+    v8_shaped_object_value a = v8_to_shaped_object(args[0]);
+
+    ASSERT_EQ(a.size, 2);
+    EXPECT_EQ(a.shape, shape);
+
+    a.data[0] = v8_new_integer(1);
+    a.data[1] = v8_new_string("first", 5);
+
+    v8_shaped_object_value b = v8_to_shaped_object(args[1]);
+
+    b.data[0] = v8_new_integer(2);
+
+    ok = v8_call_function(check, 2, args, &res, &err);
+
+    EXPECT_TRUE(ok) << err.message;
+
+    EXPECT_TRUE(v8_to_bool(res));
+
+    v8_delete_value(&args[0]);
+    v8_delete_value(&args[1]);
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_function(check);
+    v8_delete_script(script);
+    v8_delete_object_shape(shape);
+}
+
+TEST_F(IsolateFixture, ObjectKeysInterning)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "[ { id: 1, description: 'a' }, { id: 2, description: 'b' } ]",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_error(&err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_array(res));
+
+    v8_array_value arr = v8_to_array(res);
+
+    ASSERT_EQ(arr.size, 2);
+
+    v8_object_value a = v8_to_object(arr.data[0]);
+    v8_object_value b = v8_to_object(arr.data[1]);
+
+    ASSERT_EQ(a.size, 2);
+    ASSERT_EQ(b.size, 2);
+
+    EXPECT_STREQ(v8_to_string(&a.data[0].first).data, "id");
+    EXPECT_STREQ(v8_to_string(&a.data[1].first).data, "description");
+
+    EXPECT_EQ(v8_to_string(&a.data[0].first).data, v8_to_string(&b.data[0].first).data);
+    EXPECT_EQ(v8_to_string(&a.data[1].first).data, v8_to_string(&b.data[1].first).data);
+
+    EXPECT_STREQ(v8_to_string(&b.data[1].second).data, "b");
+
+    v8_delete_value(&arr.data[0]);
+
+    EXPECT_STREQ(v8_to_string(&b.data[1].first).data, "description");
+
+    v8_delete_value(&res);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, ReferencesConversion)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function check(x) {\n"
+        "    return x.self === x && x.items[0] === x.items[1] && x.items[2] === x.items\n"
+        "}\n"
+        "var shared = { id: 7 }\n"
+        "var doc = { items: [ shared, shared ] }\n"
+        "doc.self = doc\n"
+        "doc.items.push(doc.items)\n"
+        "doc",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_object(res));
+
+    v8_object_value doc = v8_to_object(res);
+
+    ASSERT_EQ(doc.size, 2);
+
+    ASSERT_TRUE(v8_is_reference(doc.data[1].second));
+    EXPECT_EQ(v8_get_value_type(doc.data[1].second), v8_reference);
+    EXPECT_EQ(v8_resolve_reference(doc.data[1].second).data, res.data);
+
+    v8_array_value items = v8_to_array(doc.data[0].second);
+
+    ASSERT_EQ(items.size, 3);
+
+    // Without v8_convert_references shared objects are copied
+    ASSERT_TRUE(v8_is_object(items.data[0]));
+    ASSERT_TRUE(v8_is_object(items.data[1]));
+    EXPECT_NE(items.data[0].data, items.data[1].data);
+
+    ASSERT_TRUE(v8_is_reference(items.data[2]));
+    EXPECT_EQ(v8_resolve_reference(items.data[2]).data, items.data);
+
+    v8_callable* check = v8_get_function(script, "check");
+
+    ASSERT_NE(check, nullptr);
+
+    v8_value back;
+    ok = v8_call_function(check, 1, &res, &back, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_FALSE(v8_to_bool(back));
+
+    v8_delete_value(&back);
+    v8_delete_value(&res);
+
+    v8_set_conversion_flags(vm, v8_convert_references);
+
+    ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    items = v8_to_array(v8_to_object(res).data[0].second);
+
+    ASSERT_EQ(items.size, 3);
+    ASSERT_TRUE(v8_is_object(items.data[0]));
+    ASSERT_TRUE(v8_is_reference(items.data[1]));
+    EXPECT_EQ(v8_resolve_reference(items.data[1]).data, items.data[0].data);
+
+    ok = v8_call_function(check, 1, &res, &back, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_TRUE(v8_to_bool(back));
+
+    v8_delete_value(&back);
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_function(check);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, DeepValuesConversion)
+{
+    const int depth = 100000;
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function depth(x) {\n"
+        "    let n = 0\n"
+        "    for (; Array.isArray(x); x = x[0]) ++n\n"
+        "    return x === 'leaf' ? n : -1\n"
+        "}\n"
+        "let v = 'leaf'\n"
+        "for (let i = 0; i < 100000; ++i) v = i % 2 ? [ v ] : { x: v }\n"
+        "v",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_value cur = res;
+    int n = 0;
+    while (v8_is_array(cur) || v8_is_object(cur))
+    {
+        cur = v8_is_array(cur)
+            ? v8_to_array(cur).data[0]
+            : v8_to_object(cur).data[0].second;
+        ++n;
+    }
+
+    EXPECT_EQ(n, depth);
+    EXPECT_STREQ(v8_to_string(&cur).data, "leaf");
+
+    v8_delete_value(&res);
+
+    EXPECT_TRUE(v8_is_undefined(res));
+
+    v8_callable* func = v8_get_function(script, "depth");
+
+    ASSERT_NE(func, nullptr);
+
+    v8_value arg = v8_new_string("leaf", 4);
+    for (int i = 0; i < depth; ++i)
+    {
+        v8_value arr = v8_new_array(1);
+        v8_to_array(arr).data[0] = arg;
+        arg = arr;
+    }
+
+    ok = v8_call_function(func, 1, &arg, &res, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_EQ(v8_to_int32(res), depth);
+
+    v8_delete_value(&res);
+    v8_delete_value(&arg);
+    v8_delete_error(&err);
+    v8_delete_function(func);
+    v8_delete_script(script);
+}
@@ -1,4 +1,8 @@
-﻿#include <gtest/gtest.h>
+﻿#include <chrono>
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
 
 #include "utils.h"
 
@@ -51,3 +55,656 @@ TEST_F(IsolateFixture, SimpleFunction)
     v8_delete_function(sum);
     v8_delete_script(script);
 }
+
+TEST_F(IsolateFixture, JsonFunction)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function merge(x, y) { return { name: x.name, total: x.value + y } }",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* merge = v8_get_function(script, "merge");
+
+    ASSERT_NE(merge, nullptr);
+
+    v8_json_buffer json = { nullptr, 0, 0 };
+
+    const char args[] = "[ { \"name\": \"doc\", \"value\": 40 }, 2 ]";
+
+    ok = v8_call_function_json(merge, args, sizeof(args) - 1, &json, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_STREQ(json.data, "{\"name\":\"doc\",\"total\":42}");
+    EXPECT_EQ(json.size, 25);
+    EXPECT_GT(json.capacity, json.size);
+
+    char* data = json.data;
+
+    ok = v8_call_function_json(merge, args, sizeof(args) - 1, &json, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_EQ(json.data, data);
+
+    ok = v8_call_function_json(merge, "[ 1, ", 5, &json, &err);
+
+    EXPECT_FALSE(ok);
+    EXPECT_NE(err.message, nullptr);
+
+    v8_delete_error(&err);
+
+    ok = v8_call_function_json(merge, "{}", 2, &json, &err);
+
+    EXPECT_FALSE(ok);
+    EXPECT_NE(err.message, nullptr);
+
+    v8_delete_error(&err);
+
+    v8_delete_json_buffer(&json);
+
+    EXPECT_EQ(json.data, nullptr);
+
+    v8_delete_function(merge);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, ManyArgumentsFunction)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function sum(...args) { return args.reduce((x, y) => x + y, 0) }",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* sum = v8_get_function(script, "sum");
+
+    ASSERT_NE(sum, nullptr);
+
+    const int N = 40;
+
+    v8_value args[N];
+    for (int i = 0; i < N; ++i)
+    {
+        args[i] = v8_new_integer(i + 1);
+    }
+
+    for (int argc : { 0, 3, 16, 17, 40, 20 })
+    {
+        ok = v8_call_function(sum, argc, argc ? args : nullptr, &res, &err);
+
+        ASSERT_TRUE(ok);
+        EXPECT_EQ(v8_to_int32(res), argc * (argc + 1) / 2);
+
+        v8_delete_value(&res);
+    }
+
+    v8_delete_error(&err);
+    v8_delete_function(sum);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, BatchFunction)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function div(x, y) { if (y === 0) throw new Error('division by zero'); return x / y }",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* div = v8_get_function(script, "div");
+
+    ASSERT_NE(div, nullptr);
+
+    const int N = 3;
+
+    v8_value args[N * 2] =
+    {
+        v8_new_integer(10), v8_new_integer(2),
+        v8_new_integer(1), v8_new_integer(0),
+        v8_new_integer(9), v8_new_integer(3)
+    };
+
+    v8_value results[N];
+    v8_error errors[N];
+
+    ok = v8_call_function_batch(div, N, 2, args, results, errors);
+
+    EXPECT_FALSE(ok);
+
+    EXPECT_EQ(v8_to_int32(results[0]), 5);
+    EXPECT_EQ(errors[0].message, nullptr);
+
+    EXPECT_TRUE(v8_is_undefined(results[1]));
+    ASSERT_NE(errors[1].message, nullptr);
+    EXPECT_NE(std::string(errors[1].message).find("division by zero"), std::string::npos);
+
+    EXPECT_EQ(v8_to_int32(results[2]), 3);
+    EXPECT_EQ(errors[2].message, nullptr);
+
+    for (int i = 0; i < N; ++i)
+    {
+        v8_delete_value(&results[i]);
+        v8_delete_error(&errors[i]);
+    }
+
+    ok = v8_call_function_batch(div, 0, 2, nullptr, nullptr, nullptr);
+
+    EXPECT_TRUE(ok);
+
+    v8_delete_error(&err);
+    v8_delete_function(div);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, BatchFunctionTermination)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function spin(x) { while (x) {} return 1 }",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* spin = v8_get_function(script, "spin");
+
+    ASSERT_NE(spin, nullptr);
+
+    const int N = 3;
+
+    v8_value args[N] =
+    {
+        v8_new_boolean(false),
+        v8_new_boolean(true),
+        v8_new_boolean(false)
+    };
+
+    v8_value results[N];
+    v8_error errors[N];
+
+    std::thread killer(
+        [script]()
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            v8_terminate_script(script);
+        });
+
+    ok = v8_call_function_batch(spin, N, 1, args, results, errors);
+
+    killer.join();
+
+    EXPECT_FALSE(ok);
+
+    EXPECT_EQ(v8_to_int32(results[0]), 1);
+    EXPECT_EQ(errors[0].message, nullptr);
+
+    EXPECT_TRUE(v8_is_undefined(results[1]));
+    EXPECT_STREQ(errors[1].message, "Script execution terminated");
+
+    EXPECT_TRUE(v8_is_undefined(results[2]));
+    EXPECT_STREQ(errors[2].message, "Script execution terminated");
+
+    for (int i = 0; i < N; ++i)
+    {
+        v8_delete_value(&results[i]);
+        v8_delete_error(&errors[i]);
+    }
+
+    v8_delete_error(&err);
+    v8_delete_function(spin);
+    v8_delete_script(script);
+}
+
+namespace
+{
+    bool host_sum(int argc, const v8_value* argv, v8_value* result, void* userdata)
+    {
+        ++*static_cast<int*>(userdata);
+
+        double sum = 0;
+        for (int i = 0; i < argc; ++i)
+        {
+            if (!v8_is_number(argv[i]))
+            {
+                *result = v8_new_string("not a number", 12);
+                return false;
+            }
+
+            sum += v8_to_double(argv[i]);
+        }
+
+        *result = v8_new_number(sum);
+        return true;
+    }
+
+    bool host_fail(int, const v8_value*, v8_value*, void*)
+    {
+        return false;
+    }
+}
+
+TEST_F(IsolateFixture, HostFunction)
+{
+    int calls = 0;
+
+    ASSERT_TRUE(v8_register_function(vm, "sum", host_sum, &calls));
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "const a = sum(1, 2, 3.5);"
+        "let b; try { sum(1, 'x') } catch (e) { b = e.message }"
+        "let c; try { fail() } catch (e) { c = e.message }"
+        "[a, b, c, sum()]",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    ASSERT_TRUE(v8_register_script_function(script, "fail", host_fail, nullptr));
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_array(res));
+
+    v8_array_value arr = v8_to_array(res);
+
+    ASSERT_EQ(arr.size, 4);
+
+    EXPECT_EQ(v8_to_double(arr.data[0]), 6.5);
+    EXPECT_STREQ(v8_to_string(&arr.data[1]).data, "not a number");
+    EXPECT_STREQ(v8_to_string(&arr.data[2]).data, "Host function failed");
+    EXPECT_EQ(v8_to_double(arr.data[3]), 0);
+
+    EXPECT_EQ(calls, 3);
+
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_script(script);
+}
+
+namespace
+{
+    double host_lookup(int argc, const double* argv, void* userdata)
+    {
+        EXPECT_EQ(argc, 1);
+
+        const auto* table = static_cast<const double*>(userdata);
+
+        const double index = argv[0];
+        if (!(index >= 0 && index < 3))
+        {
+            return -1;
+        }
+
+        return table[static_cast<int>(index)];
+    }
+}
+
+TEST_F(IsolateFixture, NumberHostFunction)
+{
+    const double table[] = { 0.5, 1.5, 2.5 };
+
+    ASSERT_TRUE(v8_register_number_function(vm, "lookup", host_lookup, 1, (void*) table));
+
+    EXPECT_FALSE(v8_register_number_function(vm, "lookup", host_lookup, 17, nullptr));
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "let sum = 0;"
+        "for (let i = 0; i < 100000; ++i) sum += lookup(i % 3);"
+        "[sum, lookup('2'), lookup(), lookup.length]",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_array(res));
+
+    v8_array_value arr = v8_to_array(res);
+
+    ASSERT_EQ(arr.size, 4);
+
+    EXPECT_EQ(v8_to_double(arr.data[0]), 33333 * 4.5 + 0.5);
+    EXPECT_EQ(v8_to_double(arr.data[1]), 2.5);
+    EXPECT_EQ(v8_to_double(arr.data[2]), -1);
+    EXPECT_EQ(v8_to_int32(arr.data[3]), 1);
+
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, MethodFunction)
+{
+    v8_set_conversion_flags(vm, v8_convert_to_handles);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "var handlers = { count: 0, onEvent(x) { this.count += x; return this.count } };"
+        "function make(k) { return function(x) { return x * k } }"
+        "handlers",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value obj;
+
+    bool ok = v8_run_script(script, &obj, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_get_function(script, "handlers.missing"), nullptr);
+    EXPECT_EQ(v8_get_function(script, "missing.onEvent"), nullptr);
+
+    v8_callable* on_event = v8_get_function(script, "handlers.onEvent");
+
+    ASSERT_NE(on_event, nullptr);
+
+    v8_value arg = v8_new_integer(2);
+    v8_value res;
+
+    ok = v8_call_function(on_event, 1, &arg, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 2);
+
+    v8_delete_value(&res);
+
+    v8_callable* method = v8_get_method(obj, "onEvent");
+
+    ASSERT_NE(method, nullptr);
+
+    EXPECT_EQ(v8_get_method(obj, "count"), nullptr);
+
+    ok = v8_call_function(method, 1, &arg, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 4);
+
+    v8_delete_value(&res);
+
+    v8_callable* make = v8_get_function(script, "make");
+
+    ASSERT_NE(make, nullptr);
+
+    arg = v8_new_integer(3);
+
+    v8_value func;
+
+    ok = v8_call_function(make, 1, &arg, &func, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* triple = v8_get_callable(func);
+
+    ASSERT_NE(triple, nullptr);
+
+    EXPECT_EQ(v8_get_callable(obj), nullptr);
+
+    arg = v8_new_integer(4);
+
+    ok = v8_call_function(triple, 1, &arg, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 12);
+
+    v8_delete_value(&res);
+    v8_delete_value(&func);
+    v8_delete_value(&obj);
+    v8_delete_error(&err);
+    v8_delete_function(triple);
+    v8_delete_function(make);
+    v8_delete_function(method);
+    v8_delete_function(on_event);
+    v8_delete_script(script);
+}
+
+namespace
+{
+    struct settled_log
+    {
+        int calls = 0;
+        int64_t sum = 0;
+    };
+
+    void on_settled(v8_promise* promise, v8_value* value, void* userdata)
+    {
+        auto log = static_cast<settled_log*>(userdata);
+
+        ++log->calls;
+
+        if (v8_promise_state(promise) == v8_promise_fulfilled)
+        {
+            log->sum += v8_to_int64(*value);
+        }
+    }
+}
+
+TEST(AsyncFunctions, AsyncFunctions)
+{
+    v8_isolate* vm = v8_new_isolate_ex(v8_explicit_microtasks);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "var resolvers = [];"
+        "function wait() { return new Promise(r => resolvers.push(r)) }"
+        "async function task(x) { const y = await wait(); if (y < 0) throw 'negative'; return x + y }"
+        "function resume(y) { resolvers.shift()(y) }"
+        "function plain(x) { return x * 2 }",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* task = v8_get_function(script, "task");
+    v8_callable* resume = v8_get_function(script, "resume");
+    v8_callable* plain = v8_get_function(script, "plain");
+
+    ASSERT_NE(task, nullptr);
+    ASSERT_NE(resume, nullptr);
+    ASSERT_NE(plain, nullptr);
+
+    settled_log log;
+
+    v8_value arg = v8_new_integer(1);
+    v8_promise* first = v8_call_function_async(task, 1, &arg, on_settled, &log, &err);
+
+    arg = v8_new_integer(2);
+    v8_promise* second = v8_call_function_async(task, 1, &arg, on_settled, &log, &err);
+
+    arg = v8_new_integer(5);
+    v8_promise* third = v8_call_function_async(plain, 1, &arg, on_settled, &log, &err);
+
+    ASSERT_NE(first, nullptr);
+    ASSERT_NE(second, nullptr);
+    ASSERT_NE(third, nullptr);
+
+    EXPECT_EQ(v8_promise_state(third), v8_promise_pending);
+    EXPECT_FALSE(v8_promise_result(third, &res));
+
+    EXPECT_EQ(v8_poll(vm), 2);
+
+    EXPECT_EQ(v8_promise_state(third), v8_promise_fulfilled);
+    EXPECT_EQ(log.calls, 1);
+    EXPECT_EQ(log.sum, 10);
+
+    arg = v8_new_integer(10);
+    ok = v8_call_function(resume, 1, &arg, &res, &err);
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    // Microtasks are explicit
+    EXPECT_EQ(v8_promise_state(first), v8_promise_pending);
+
+    EXPECT_EQ(v8_poll(vm), 1);
+
+    EXPECT_EQ(v8_promise_state(first), v8_promise_fulfilled);
+    EXPECT_EQ(log.sum, 21);
+
+    ASSERT_TRUE(v8_promise_result(first, &res));
+    EXPECT_EQ(v8_to_int32(res), 11);
+    v8_delete_value(&res);
+
+    arg = v8_new_integer(-1);
+    ok = v8_call_function(resume, 1, &arg, &res, &err);
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_poll(vm), 0);
+
+    EXPECT_EQ(v8_promise_state(second), v8_promise_rejected);
+    EXPECT_EQ(log.calls, 3);
+
+    ASSERT_TRUE(v8_promise_result(second, &res));
+    EXPECT_EQ(std::string(v8_to_string(&res).data), "negative");
+    v8_delete_value(&res);
+
+    // Deleted while pending and never settled
+    arg = v8_new_integer(3);
+    v8_promise* abandoned = v8_call_function_async(task, 1, &arg, on_settled, &log, &err);
+
+    ASSERT_NE(abandoned, nullptr);
+
+    v8_delete_promise(abandoned);
+
+    EXPECT_EQ(v8_poll(vm), 0);
+
+    v8_delete_promise(first);
+    v8_delete_promise(second);
+    v8_delete_promise(third);
+    v8_delete_error(&err);
+    v8_delete_function(task);
+    v8_delete_function(resume);
+    v8_delete_function(plain);
+    v8_delete_script(script);
+    v8_delete_isolate(vm);
+
+    EXPECT_EQ(log.calls, 3);
+}
+
+TEST_F(IsolateFixture, Globals)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function scaled() { return config.factor * value }",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script(script, &res, &err);
+
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_value config = v8_new_object(1);
+
+    v8_object_value obj = v8_to_object(config);
+    obj.data[0].first = v8_new_string("factor", 6);
+    obj.data[0].second = v8_new_integer(3);
+
+    ok = v8_set_global(script, "config", config, &err);
+
+    v8_delete_value(&config);
+
+    ASSERT_TRUE(ok);
+
+    ok = v8_set_global(script, "value", v8_new_integer(7), &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* scaled = v8_get_function(script, "scaled");
+
+    ASSERT_NE(scaled, nullptr);
+
+    ok = v8_call_function(scaled, 0, nullptr, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 21);
+
+    v8_delete_value(&res);
+
+    ok = v8_get_global(script, "value", &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 7);
+
+    v8_delete_value(&res);
+
+    ok = v8_get_global(script, "missing", &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_TRUE(v8_is_undefined(res));
+
+    v8_delete_error(&err);
+    v8_delete_function(scaled);
+    v8_delete_script(script);
+}
@@ -0,0 +1,141 @@
+﻿#include <gtest/gtest.h>
+
+#include "../include/v8capi.h"
+
+#include "isolate_fixture.h"
+
+TEST_F(IsolateFixture, HandleAccessors)
+{
+    v8_set_conversion_flags(vm, v8_convert_to_handles);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "({ meta: { items: [ { id: 10 }, { id: 11 } ] }, name: 'doc' })",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value doc;
+
+    bool ok = v8_run_script(script, &doc, &err);
+
+    ASSERT_TRUE(ok);
+
+    ASSERT_TRUE(v8_is_handle(doc));
+    EXPECT_EQ(v8_get_value_type(doc), v8_handle);
+
+    EXPECT_EQ(v8_get_length(doc), 2);
+
+    v8_value name;
+    ok = v8_get_property(doc, "name", &name, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_STREQ(v8_to_string(&name).data, "doc");
+
+    v8_value meta;
+    ok = v8_get_property(doc, "meta", &meta, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_handle(meta));
+
+    v8_value items;
+    ok = v8_get_property(meta, "items", &items, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_handle(items));
+
+    EXPECT_EQ(v8_get_length(items), 2);
+
+    v8_value item;
+    ok = v8_get_element(items, 1, &item, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_handle(item));
+
+    v8_value keys;
+    ok = v8_get_keys(item, &keys, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_array(keys));
+    ASSERT_EQ(v8_to_array(keys).size, 1);
+    EXPECT_STREQ(v8_to_string(&v8_to_array(keys).data[0]).data, "id");
+
+    v8_value materialized;
+    ok = v8_materialize(item, &materialized, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_object(materialized));
+
+    v8_object_value obj = v8_to_object(materialized);
+
+    ASSERT_EQ(obj.size, 1);
+    EXPECT_EQ(v8_to_int32(obj.data[0].second), 11);
+
+    v8_delete_value(&materialized);
+    v8_delete_value(&keys);
+    v8_delete_value(&item);
+    v8_delete_value(&items);
+    v8_delete_value(&meta);
+    v8_delete_value(&name);
+
+    EXPECT_TRUE(v8_is_undefined(item));
+
+    v8_script* check = v8_compile_script(vm,
+        "function check(doc) { return doc.meta.items[0].id === 10 }",
+        "check.js", &err);
+
+    ASSERT_NE(check, nullptr);
+
+    v8_value skip;
+    ok = v8_run_script(check, &skip, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* func = v8_get_function(check, "check");
+
+    ASSERT_NE(func, nullptr);
+
+    v8_value res;
+    ok = v8_call_function(func, 1, &doc, &res, &err);
+
+    EXPECT_TRUE(ok) << err.message;
+    EXPECT_TRUE(v8_to_bool(res));
+
+    v8_delete_value(&res);
+    v8_delete_value(&skip);
+    v8_delete_value(&doc);
+    v8_delete_error(&err);
+    v8_delete_function(func);
+    v8_delete_script(check);
+    v8_delete_script(script);
+}
+
+TEST_F(IsolateFixture, HandleAccessorErrors)
+{
+    v8_set_conversion_flags(vm, v8_convert_to_handles);
+
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "({ get broken() { throw new Error('getter failed') } })",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value obj;
+
+    bool ok = v8_run_script(script, &obj, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_value res;
+    ok = v8_get_property(obj, "broken", &res, &err);
+
+    EXPECT_FALSE(ok);
+    EXPECT_STREQ(err.message, "Error: getter failed");
+
+    v8_delete_error(&err);
+    v8_delete_value(&obj);
+    v8_delete_script(script);
+}
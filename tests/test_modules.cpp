@@ -0,0 +1,140 @@
+﻿#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "../include/v8capi.h"
+
+#include "isolate_fixture.h"
+
+namespace
+{
+    char* copy_string(const std::string& str)
+    {
+        auto result = static_cast<char*>(std::malloc(str.size() + 1));
+        std::memcpy(result, str.c_str(), str.size() + 1);
+        return result;
+    }
+
+    bool resolve_module(
+        const char* specifier, const char*, char** location, char** code, void* userdata)
+    {
+        ++*static_cast<int*>(userdata);
+
+        if (std::strcmp(specifier, "shared.js") != 0)
+        {
+            return false;
+        }
+
+        *location = copy_string(specifier);
+        *code = copy_string(
+            "globalThis.loads = (globalThis.loads || 0) + 1;"
+            "export function twice(x) { return x * 2 }");
+
+        return true;
+    }
+}
+
+TEST_F(IsolateFixture, Modules)
+{
+    int resolved = 0;
+
+    v8_set_module_resolver(vm, resolve_module, &resolved);
+
+    v8_error err;
+
+    v8_script* a = v8_compile_module(vm,
+        "import { twice } from 'shared.js';"
+        "export function f(x) { return twice(x) + 1 }",
+        "a.js", &err);
+
+    ASSERT_NE(a, nullptr);
+
+    v8_script* b = v8_compile_module(vm,
+        "import { twice } from 'shared.js';"
+        "export const value = twice(21);"
+        "export function loads() { return globalThis.loads }",
+        "b.js", &err);
+
+    ASSERT_NE(b, nullptr);
+
+    EXPECT_EQ(resolved, 2);
+
+    v8_value res;
+
+    bool ok = v8_run_script(a, &res, &err);
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    ok = v8_run_script(b, &res, &err);
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_callable* f = v8_get_function(a, "f");
+
+    ASSERT_NE(f, nullptr);
+
+    v8_value arg = v8_new_integer(5);
+
+    ok = v8_call_function(f, 1, &arg, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 11);
+
+    v8_delete_value(&res);
+
+    // The shared module is evaluated once
+    v8_callable* loads = v8_get_function(b, "loads");
+
+    ASSERT_NE(loads, nullptr);
+
+    ok = v8_call_function(loads, 0, nullptr, &res, &err);
+
+    ASSERT_TRUE(ok);
+
+    EXPECT_EQ(v8_to_int32(res), 1);
+
+    v8_delete_value(&res);
+
+    EXPECT_EQ(v8_get_function(a, "twice"), nullptr);
+
+    v8_script* missing = v8_compile_module(vm,
+        "import 'missing.js'", "c.js", &err);
+
+    EXPECT_EQ(missing, nullptr);
+    ASSERT_NE(err.message, nullptr);
+    EXPECT_NE(std::string(err.message).find("Cannot find module 'missing.js'"), std::string::npos);
+
+    v8_delete_error(&err);
+
+    // The failed module is not cached, so fixed code is compiled
+    v8_script* fixed = v8_compile_module(vm,
+        "import { twice } from 'shared.js';"
+        "export const value = twice(2)",
+        "c.js", &err);
+
+    ASSERT_NE(fixed, nullptr);
+
+    ok = v8_run_script(fixed, &res, &err);
+    v8_delete_value(&res);
+
+    ASSERT_TRUE(ok);
+
+    v8_delete_script(fixed);
+
+    v8_script* invalid = v8_compile_module(vm,
+        "export let = 1", "d.js", &err);
+
+    EXPECT_EQ(invalid, nullptr);
+    EXPECT_NE(err.message, nullptr);
+
+    v8_delete_error(&err);
+    v8_delete_function(loads);
+    v8_delete_function(f);
+    v8_delete_script(b);
+    v8_delete_script(a);
+}
@@ -109,3 +109,144 @@ TEST_F(SomeIsolatesFixture, SomeIsolatesFixture)
     EXPECT_EQ(res3, 4);
     EXPECT_EQ(res4, 4);
 }
+
+TEST_F(SomeIsolatesFixture, Sessions)
+{
+    const int N = 100;
+
+    std::string code = read_file("good_script.js");
+
+    auto run = [&code](v8_isolate* vm, int64_t& res)
+        {
+            v8_error err;
+            v8_value val;
+
+            v8_enter(vm);
+            v8_enter(vm);
+
+            v8_script* script =
+                v8_compile_script(vm, code.c_str(), "my.js", &err);
+
+            v8_leave(vm);
+
+            for (int i = 0; i < N; ++i)
+            {
+                v8_run_script(script, &val, &err);
+                res += v8_to_int64(val);
+                v8_delete_value(&val);
+            }
+
+            v8_delete_script(script);
+
+            v8_leave(vm);
+
+            v8_delete_error(&err);
+        };
+
+    int64_t res1 = 0;
+    int64_t res2 = 0;
+    int64_t res3 = 0;
+
+    std::thread t1([&]() { run(vm1, res1); });
+    std::thread t2([&]() { run(vm1, res2); });
+    std::thread t3([&]() { run(vm2, res3); });
+
+    t1.join();
+    t2.join();
+    t3.join();
+
+    EXPECT_NE(res1, 0);
+    EXPECT_EQ(res1, res2);
+    EXPECT_EQ(res1, res3);
+}
+
+TEST(ThreadConfinedIsolates, ThreadConfinedIsolates)
+{
+    std::string code = read_file("good_script.js");
+
+    int64_t res[2] = { 0, 0 };
+
+    auto run = [&code](int64_t& res)
+        {
+            v8_isolate* vm = v8_new_isolate_ex(v8_thread_confined);
+
+            v8_error err;
+            v8_value val;
+
+            v8_script* script =
+                v8_compile_script(vm, code.c_str(), "my.js", &err);
+
+            v8_enter(vm);
+
+            for (int i = 0; i < 100; ++i)
+            {
+                v8_run_script(script, &val, &err);
+                res += v8_to_int64(val);
+                v8_delete_value(&val);
+            }
+
+            v8_leave(vm);
+
+            v8_delete_script(script);
+            v8_delete_error(&err);
+            v8_delete_isolate(vm);
+        };
+
+    std::thread t1([&]() { run(res[0]); });
+    std::thread t2([&]() { run(res[1]); });
+
+    t1.join();
+    t2.join();
+
+    EXPECT_NE(res[0], 0);
+    EXPECT_EQ(res[0], res[1]);
+}
+
+TEST(ThreadConfinedIsolates, SameThread)
+{
+    v8_isolate* vm1 = v8_new_isolate_ex(v8_thread_confined);
+    v8_isolate* vm2 = v8_new_isolate_ex(v8_thread_confined);
+
+    v8_error err;
+    v8_value val;
+
+    v8_script* s1 = v8_compile_script(vm1, "var n = (this.n || 0) + 1; n", "s1.js", &err);
+    v8_script* s2 = v8_compile_script(vm2, "var n = (this.n || 0) + 10; n", "s2.js", &err);
+
+    ASSERT_NE(s1, nullptr);
+    ASSERT_NE(s2, nullptr);
+
+    for (int i = 1; i <= 3; ++i)
+    {
+        ASSERT_TRUE(v8_run_script(s1, &val, &err));
+        EXPECT_EQ(v8_to_int32(val), i);
+        v8_delete_value(&val);
+
+        ASSERT_TRUE(v8_run_script(s2, &val, &err));
+        EXPECT_EQ(v8_to_int32(val), i * 10);
+        v8_delete_value(&val);
+    }
+
+    // Not in the order of creation
+    v8_delete_script(s1);
+    v8_delete_isolate(vm1);
+
+    ASSERT_TRUE(v8_run_script(s2, &val, &err));
+    EXPECT_EQ(v8_to_int32(val), 40);
+    v8_delete_value(&val);
+
+    v8_isolate* vm3 = v8_new_isolate_ex(v8_thread_confined);
+
+    v8_script* s3 = v8_compile_script(vm3, "2 + 2", "s3.js", &err);
+
+    ASSERT_NE(s3, nullptr);
+    ASSERT_TRUE(v8_run_script(s3, &val, &err));
+    EXPECT_EQ(v8_to_int32(val), 4);
+    v8_delete_value(&val);
+
+    v8_delete_script(s3);
+    v8_delete_script(s2);
+    v8_delete_error(&err);
+    v8_delete_isolate(vm2);
+    v8_delete_isolate(vm3);
+}
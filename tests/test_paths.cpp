@@ -0,0 +1,107 @@
+﻿#include <gtest/gtest.h>
+
+#include "../include/v8capi.h"
+
+#include "isolate_fixture.h"
+
+TEST(Paths, Compilation)
+{
+    const char* good[] =
+    {
+        "",
+        "meta",
+        "meta.items[3].id",
+        "items[*].id",
+        "rows.*.name",
+        "headers[\"content-type\"]",
+        "[0]['x']"
+    };
+
+    for (const char* p : good)
+    {
+        v8_path* path = v8_compile_path(p);
+        EXPECT_NE(path, nullptr) << p;
+        if (path)
+        {
+            v8_delete_path(path);
+        }
+    }
+
+    const char* bad[] =
+    {
+        ".x",
+        "x.",
+        "x..y",
+        "x[",
+        "x[1",
+        "x[a]",
+        "x[\"y]",
+        "x[99999999999]"
+    };
+
+    for (const char* p : bad)
+    {
+        EXPECT_EQ(v8_compile_path(p), nullptr) << p;
+    }
+}
+
+TEST_F(IsolateFixture, PathSelection)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm,
+        "function get() { return { meta: { items: [ { id: 1 }, { id: 2 }, { id: 3 }, { id: 4 } ] } } }\n"
+        "get()",
+        "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_path* single = v8_compile_path("meta.items[3].id");
+    v8_path* all = v8_compile_path("meta.items[*].id");
+    v8_path* missing = v8_compile_path("meta.nothing.id");
+
+    ASSERT_NE(single, nullptr);
+    ASSERT_NE(all, nullptr);
+    ASSERT_NE(missing, nullptr);
+
+    v8_value res;
+
+    bool ok = v8_run_script_select(script, single, &res, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_TRUE(v8_is_integer(res));
+    EXPECT_EQ(v8_to_int32(res), 4);
+
+    v8_delete_value(&res);
+
+    ok = v8_run_script_select(script, missing, &res, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_TRUE(v8_is_undefined(res));
+
+    v8_callable* get = v8_get_function(script, "get");
+
+    ASSERT_NE(get, nullptr);
+
+    ok = v8_call_function_select(get, 0, nullptr, all, &res, &err);
+
+    ASSERT_TRUE(ok) << err.message;
+    ASSERT_TRUE(v8_is_array(res));
+
+    v8_array_value arr = v8_to_array(res);
+
+    ASSERT_EQ(arr.size, 4);
+
+    for (int i = 0; i < arr.size; ++i)
+    {
+        EXPECT_EQ(v8_to_int32(arr.data[i]), i + 1);
+    }
+
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_function(get);
+    v8_delete_path(single);
+    v8_delete_path(all);
+    v8_delete_path(missing);
+    v8_delete_script(script);
+}
@@ -0,0 +1,250 @@
+﻿#include <gtest/gtest.h>
+
+#include "../include/v8capi.h"
+
+#include "isolate_fixture.h"
+
+TEST_F(SomeIsolatesFixture, ValueSerialization)
+{
+    v8_set_conversion_flags(vm1, v8_convert_to_handles);
+
+    v8_error err;
+
+    v8_script* source = v8_compile_script(vm1,
+        "({ numbers: new Float64Array([1.5, 2.5, 3.5]), name: 'doc', tags: [ 'a', 'b' ] })",
+        "source.js", &err);
+
+    ASSERT_NE(source, nullptr);
+
+    v8_value doc;
+
+    bool ok = v8_run_script(source, &doc, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_TRUE(v8_is_handle(doc));
+
+    v8_serialized_value data;
+
+    ok = v8_serialize_value(source, doc, v8_move_buffers, &data, &err);
+
+    ASSERT_TRUE(ok) << err.message;
+    EXPECT_NE(data.data, nullptr);
+    EXPECT_GT(data.size, 0u);
+
+    v8_value numbers;
+    ok = v8_get_property(doc, "numbers", &numbers, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_value moved;
+    ok = v8_materialize(numbers, &moved, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(v8_get_value_type(moved), v8_float64_array);
+    EXPECT_EQ(v8_to_typed_array(moved).size, 0);
+
+    v8_script* target = v8_compile_script(vm2, "", "target.js", &err);
+
+    ASSERT_NE(target, nullptr);
+
+    v8_value res;
+    ok = v8_deserialize_value(target, &data, &res, &err);
+
+    ASSERT_TRUE(ok) << err.message;
+    ASSERT_TRUE(v8_is_object(res));
+
+    v8_object_value obj = v8_to_object(res);
+
+    ASSERT_EQ(obj.size, 3);
+
+    EXPECT_STREQ(v8_to_string(&obj.data[0].first).data, "numbers");
+    ASSERT_EQ(v8_get_value_type(obj.data[0].second), v8_float64_array);
+
+    v8_buffer_value buffer = v8_to_typed_array(obj.data[0].second);
+
+    ASSERT_EQ(buffer.size, 3);
+    EXPECT_EQ(static_cast<double*>(buffer.data)[0], 1.5);
+    EXPECT_EQ(static_cast<double*>(buffer.data)[2], 3.5);
+
+    EXPECT_STREQ(v8_to_string(&obj.data[1].second).data, "doc");
+
+    ASSERT_TRUE(v8_is_array(obj.data[2].second));
+    EXPECT_EQ(v8_to_array(obj.data[2].second).size, 2);
+
+    v8_delete_value(&res);
+    v8_delete_serialized_value(&data);
+
+    EXPECT_EQ(data.data, nullptr);
+
+    v8_delete_value(&moved);
+    v8_delete_value(&numbers);
+    v8_delete_value(&doc);
+    v8_delete_error(&err);
+    v8_delete_script(target);
+    v8_delete_script(source);
+}
+
+TEST_F(SomeIsolatesFixture, ValueSerializationCopy)
+{
+    v8_set_conversion_flags(vm1, v8_convert_to_handles);
+
+    v8_error err;
+
+    v8_script* source = v8_compile_script(vm1, "new Int32Array([1, 2, 3])", "source.js", &err);
+
+    ASSERT_NE(source, nullptr);
+
+    v8_value numbers;
+
+    bool ok = v8_run_script(source, &numbers, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_serialized_value data;
+
+    ok = v8_serialize_value(source, numbers, 0, &data, &err);
+
+    ASSERT_TRUE(ok) << err.message;
+
+    v8_value copied;
+    ok = v8_materialize(numbers, &copied, &err);
+
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(v8_get_value_type(copied), v8_int32_array);
+    EXPECT_EQ(v8_to_typed_array(copied).size, 3);
+
+    v8_script* target = v8_compile_script(vm2, "", "target.js", &err);
+
+    ASSERT_NE(target, nullptr);
+
+    v8_value res;
+    ok = v8_deserialize_value(target, &data, &res, &err);
+
+    ASSERT_TRUE(ok) << err.message;
+    ASSERT_EQ(v8_get_value_type(res), v8_int32_array);
+
+    v8_buffer_value buffer = v8_to_typed_array(res);
+
+    ASSERT_EQ(buffer.size, 3);
+    EXPECT_EQ(static_cast<int32_t*>(buffer.data)[1], 2);
+
+    v8_delete_value(&res);
+    v8_delete_serialized_value(&data);
+    v8_delete_value(&copied);
+    v8_delete_value(&numbers);
+    v8_delete_error(&err);
+    v8_delete_script(target);
+    v8_delete_script(source);
+}
+
+TEST_F(SomeIsolatesFixture, ValueSerializationSourceDeleted)
+{
+    v8_isolate* vm = v8_new_isolate();
+
+    v8_set_conversion_flags(vm, v8_convert_to_handles);
+
+    v8_error err;
+
+    v8_script* source = v8_compile_script(vm, "new Float64Array([0.5, 1.5])", "source.js", &err);
+
+    ASSERT_NE(source, nullptr);
+
+    v8_value numbers;
+
+    bool ok = v8_run_script(source, &numbers, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_serialized_value data;
+
+    ok = v8_serialize_value(source, numbers, v8_move_buffers, &data, &err);
+
+    ASSERT_TRUE(ok) << err.message;
+
+    v8_delete_value(&numbers);
+    v8_delete_script(source);
+    v8_delete_isolate(vm);
+
+    v8_script* target = v8_compile_script(vm1, "", "target.js", &err);
+
+    ASSERT_NE(target, nullptr);
+
+    v8_value res;
+    ok = v8_deserialize_value(target, &data, &res, &err);
+
+    ASSERT_TRUE(ok) << err.message;
+    ASSERT_EQ(v8_get_value_type(res), v8_float64_array);
+    EXPECT_EQ(static_cast<double*>(v8_to_typed_array(res).data)[1], 1.5);
+
+    v8_delete_serialized_value(&data);
+    v8_delete_value(&res);
+    v8_delete_error(&err);
+    v8_delete_script(target);
+}
+
+TEST_F(IsolateFixture, ValueSerializationErrors)
+{
+    v8_error err;
+
+    v8_script* script = v8_compile_script(vm, "", "my.js", &err);
+
+    ASSERT_NE(script, nullptr);
+
+    v8_value value = v8_new_string("plain", 5);
+
+    v8_serialized_value data;
+
+    bool ok = v8_serialize_value(script, value, 0, &data, &err);
+
+    ASSERT_TRUE(ok);
+
+    v8_value res;
+    ok = v8_deserialize_value(script, &data, &res, &err);
+
+    ASSERT_TRUE(ok);
+    EXPECT_STREQ(v8_to_string(&res).data, "plain");
+
+    v8_delete_value(&res);
+    v8_delete_serialized_value(&data);
+
+    v8_set_conversion_flags(vm, v8_convert_to_handles);
+
+    v8_script* func = v8_compile_script(vm, "(function() {})", "func.js", &err);
+
+    ASSERT_NE(func, nullptr);
+
+    v8_value handle;
+    ok = v8_run_script(func, &handle, &err);
+
+    ASSERT_TRUE(ok);
+
+    ok = v8_serialize_value(func, handle, 0, &data, &err);
+
+    EXPECT_FALSE(ok);
+    EXPECT_NE(err.message, nullptr);
+
+    v8_delete_error(&err);
+
+    v8_script* shared = v8_compile_script(vm,
+        "new Int32Array(new SharedArrayBuffer(16))", "shared.js", &err);
+
+    ASSERT_NE(shared, nullptr);
+
+    v8_value view;
+    ok = v8_run_script(shared, &view, &err);
+
+    ASSERT_TRUE(ok);
+
+    ok = v8_serialize_value(shared, view, v8_move_buffers, &data, &err);
+
+    EXPECT_FALSE(ok);
+    EXPECT_NE(err.message, nullptr);
+
+    v8_delete_value(&view);
+    v8_delete_script(shared);
+    v8_delete_value(&handle);
+    v8_delete_value(&value);
+    v8_delete_error(&err);
+    v8_delete_script(func);
+    v8_delete_script(script);
+}
@@ -284,6 +284,40 @@ TEST_F(IsolateFixture, to_double)
 #endif
 }
 
+TEST_F(IsolateFixture, BigIntValue)
+{
+    {
+        const int64_t x = std::numeric_limits<int64_t>::min();
+
+        v8_value val = v8_new_big_int(x);
+
+        EXPECT_EQ(v8_get_value_type(val), v8_big_int);
+
+        EXPECT_EQ(v8_is_number(val), false);
+        EXPECT_EQ(v8_is_integer(val), false);
+        EXPECT_EQ(v8_is_big_int(val), true);
+
+        EXPECT_EQ(v8_to_int64(val), x);
+
+        v8_delete_value(&val);
+
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+    {
+        const uint64_t x = std::numeric_limits<uint64_t>::max();
+
+        v8_value val = v8_new_big_uint(x);
+
+        EXPECT_EQ(v8_get_value_type(val), v8_big_int);
+        EXPECT_EQ(v8_is_big_int(val), true);
+
+        EXPECT_EQ(v8_to_uint64(val), x);
+
+        v8_delete_value(&val);
+    }
+}
+
 TEST_F(IsolateFixture, StringValue)
 {
     {
@@ -372,6 +406,199 @@ TEST_F(IsolateFixture, StringValue)
 #endif
 }
 
+void count_release(void* /*data*/, void* userdata)
+{
+    ++*static_cast<int*>(userdata);
+}
+
+TEST_F(IsolateFixture, ExternalStringValue)
+{
+    {
+        const std::string x = "long long long external string";
+
+        int released = 0;
+
+        v8_value val = v8_new_external_string(
+            x.c_str(), static_cast<int32_t>(x.length()), count_release, &released);
+
+        EXPECT_EQ(v8_get_value_type(val), v8_string);
+        EXPECT_TRUE(v8_is_string(val));
+
+        v8_string_value str = v8_to_string(&val);
+
+        EXPECT_EQ(static_cast<size_t>(str.size), x.length());
+        EXPECT_EQ(str.data, x.c_str());
+
+        v8_delete_value(&val);
+
+        EXPECT_EQ(released, 1);
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+    {
+        const std::u16string x = u"utf-16 string";
+
+        int released = 0;
+
+        v8_value val = v8_new_external_string16(
+            reinterpret_cast<const uint16_t*>(x.c_str()),
+            static_cast<int32_t>(x.length()),
+            count_release,
+            &released);
+
+        EXPECT_TRUE(v8_is_string(val));
+
+        v8_string_value str = v8_to_string(&val);
+
+        EXPECT_EQ(str.size, 0);
+        EXPECT_EQ(str.data, nullptr);
+
+        v8_delete_value(&val);
+
+        EXPECT_EQ(released, 1);
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+#ifdef NDEBUG
+    {
+        v8_value val = v8_new_external_string(nullptr, 0, nullptr, nullptr);
+
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+#endif
+}
+
+TEST_F(IsolateFixture, ArrayBufferValue)
+{
+    {
+        char data[16] = {};
+
+        int released = 0;
+
+        v8_value val = v8_new_array_buffer(data, sizeof(data), count_release, &released);
+
+        EXPECT_EQ(v8_get_value_type(val), v8_array_buffer);
+
+        EXPECT_EQ(v8_is_object(val), false);
+        EXPECT_EQ(v8_is_array(val), false);
+        EXPECT_EQ(v8_is_array_buffer(val), true);
+        EXPECT_EQ(v8_is_typed_array(val), false);
+
+        v8_buffer_value buf = v8_to_array_buffer(val);
+
+        EXPECT_EQ(buf.size, 16);
+        EXPECT_EQ(buf.data, data);
+
+        v8_delete_value(&val);
+
+        EXPECT_EQ(released, 1);
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+    {
+        double data[4] = {};
+
+        int released = 0;
+
+        v8_value val = v8_new_typed_array(v8_float64_array, data, 4, count_release, &released);
+
+        EXPECT_EQ(v8_get_value_type(val), v8_float64_array);
+
+        EXPECT_EQ(v8_is_array_buffer(val), false);
+        EXPECT_EQ(v8_is_typed_array(val), true);
+
+        v8_buffer_value buf = v8_to_typed_array(val);
+
+        EXPECT_EQ(buf.size, 4);
+        EXPECT_EQ(buf.data, data);
+
+        v8_delete_value(&val);
+
+        EXPECT_EQ(released, 1);
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+#ifdef NDEBUG
+    {
+        v8_value val = v8_new_typed_array(v8_array, nullptr, 0, nullptr, nullptr);
+
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+    {
+        v8_value val = v8_new_undefined();
+
+        v8_buffer_value buf = v8_to_typed_array(val);
+
+        EXPECT_EQ(buf.size, 0);
+        EXPECT_EQ(buf.data, nullptr);
+    }
+#endif
+}
+
+TEST_F(IsolateFixture, NumberArrayValue)
+{
+    {
+        const double data[] = { 1.5, 2.5, 3.5 };
+
+        v8_value val = v8_new_number_array(data, 3);
+
+        EXPECT_EQ(v8_get_value_type(val), v8_number_array);
+
+        EXPECT_EQ(v8_is_number(val), false);
+        EXPECT_EQ(v8_is_double(val), false);
+        EXPECT_EQ(v8_is_integer(val), false);
+        EXPECT_EQ(v8_is_array(val), false);
+        EXPECT_EQ(v8_is_number_array(val), true);
+
+        v8_number_array_value arr = v8_to_number_array(val);
+
+        ASSERT_EQ(arr.size, 3);
+        ASSERT_NE(arr.numbers, nullptr);
+        EXPECT_EQ(arr.integers, nullptr);
+
+        EXPECT_NE(arr.numbers, data);
+        EXPECT_EQ(arr.numbers[0], 1.5);
+        EXPECT_EQ(arr.numbers[2], 3.5);
+
+        v8_delete_value(&val);
+
+        EXPECT_EQ(v8_get_value_type(val), v8_undefined);
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+    {
+        const int32_t data[] = { 1, -2 };
+
+        v8_value val = v8_new_integer_array(data, 2);
+
+        EXPECT_TRUE(v8_is_number_array(val));
+        EXPECT_FALSE(v8_is_double(val));
+        EXPECT_FALSE(v8_is_integer(val));
+
+        v8_number_array_value arr = v8_to_number_array(val);
+
+        ASSERT_EQ(arr.size, 2);
+        EXPECT_EQ(arr.numbers, nullptr);
+        ASSERT_NE(arr.integers, nullptr);
+
+        EXPECT_EQ(arr.integers[0], 1);
+        EXPECT_EQ(arr.integers[1], -2);
+
+        v8_delete_value(&val);
+
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+
+#ifdef NDEBUG
+    {
+        v8_value val = v8_new_number_array(nullptr, -1);
+
+        EXPECT_TRUE(v8_is_undefined(val));
+    }
+#endif
+}
+
 TEST_F(IsolateFixture, ObjectValue)
 {
     {